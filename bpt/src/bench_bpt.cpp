@@ -0,0 +1,93 @@
+#include "tree.hpp"
+#include "blockblocklist.hpp"
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <chrono>
+#include <random>
+using std::cout;
+struct KeyAndValue {
+  static size_t const N = 65;
+  char str[N];
+  int value;
+  KeyAndValue(const char *str_ = "", int value_ = 0) : value(value_) {
+    std::strncpy(str, str_, N);
+  }
+  bool operator < (const KeyAndValue &other) const {
+    int i = std::strcmp(str, other.str);
+    return i ? i < 0 : value < other.value;
+  }
+};
+struct Operation {
+  char type; // 'i'nsert, 'd'elete or 'f'ind, as in main_bpt.cpp
+  KeyAndValue data;
+};
+// The main_bpt.cpp workload: half inserts, a fifth deletes of live entries and
+// finds of every value stored under a key, over n / 8 distinct keys.
+vector<Operation> workload(int n) {
+  std::mt19937 rng(20250301);
+  vector<Operation> ops;
+  vector<KeyAndValue> live;
+  char key[KeyAndValue::N];
+  for (int i = 0; i < n; i++) {
+    std::snprintf(key, sizeof(key), "key%08u", static_cast<unsigned>(rng() % (n / 8 + 1)));
+    unsigned dice = rng() % 10;
+    if (dice < 5 || live.empty()) {
+      KeyAndValue x(key, i);
+      live.push_back(x);
+      ops.push_back({'i', x});
+    } else if (dice < 7) {
+      int j = rng() % live.size();
+      ops.push_back({'d', live[j]});
+      live[j] = live.back();
+      live.pop_back();
+    } else {
+      ops.push_back({'f', KeyAndValue(key, 0)});
+    }
+  }
+  return ops;
+}
+template<typename Index>
+void run(const char *name, Index &index, const vector<Operation> &ops) {
+  auto start = std::chrono::steady_clock::now();
+  long long checksum = 0;
+  for (size_t i = 0; i < ops.size(); i++) {
+    const Operation &op = ops[i];
+    if (op.type == 'i') {
+      index.insert(op.data);
+    } else if (op.type == 'd') {
+      index.erase(op.data);
+    } else {
+      for (auto result = index.scan(KeyAndValue(op.data.str, INT_MIN), KeyAndValue(op.data.str, INT_MAX));
+           result; ++result) {
+        checksum = checksum * 31 + result->value;
+      }
+    }
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  cout << name << ": " << elapsed.count() << " s, " << ops.size() / elapsed.count()
+       << " ops/s, checksum " << checksum << '\n';
+}
+int main(int argc, char **argv) {
+  int n = argc > 1 ? std::atoi(argv[1]) : 100000;
+  vector<Operation> ops = workload(n);
+  std::remove("bench_tree");
+  std::remove("bench_list");
+  std::remove("bench_bbl");
+  {
+    BPlusTree<KeyAndValue, 161, FileStorage> tree("bench_tree");
+    run("BPlusTree", tree, ops);
+  }
+  {
+    BlockBlockList<KeyAndValue, 161, FileStorage> bbl("bench_bbl");
+    run("BlockBlockList", bbl, ops);
+  }
+  {
+    BlockList<KeyAndValue, 161, FileStorage> list(sizeof(int), "bench_list");
+    list.build_index();
+    run("BlockList", list, ops);
+  }
+  return 0;
+}
@@ -4,15 +4,30 @@
 #define BPT_BBL_
 
 #include <string_view>
+#include <vector>
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <type_traits>
 #include "file.hpp"
 #include "list_bbl.hpp"
+#include "latch.hpp"
 #include "utility.hpp"
 
 using std::string_view;
 
-template<typename Data, size_t block_size, typename Storage = FileStorage>
-requires (std::is_base_of<BasicStorage, Storage>::value && !is_sjtu_pair_with_int<Data>::value)
+// With concurrent set, any number of threads may use the list at once, given a
+// storage whose reads and writes may be issued from several threads, such as
+// FileStorage. A root latch guards the heads: taken shared by inserts and erases
+// that stay inside one leaf without moving its first entry, exclusively by
+// everything else. Below it every leaf has a reader/writer latch, taken while the
+// root latch is held, so such writers only exclude writers of their own leaf.
+// The heads are changed only under the exclusive root latch and are read without
+// latches of their own. Lookups take no latch at all; see OptimisticCursor.
+template<typename Data, size_t block_size, typename Storage = FileStorage, bool concurrent = false>
+requires (random_access_storage<Storage> && !is_sjtu_pair_with_int<Data>::value)
 class BlockBlockList {
  private:
   static int const HEAD_ROOT = BlockList<Data, block_size, Storage>::ROOT_SIZE;
@@ -25,18 +40,311 @@ class BlockBlockList {
   InitializeHelper helper;
   BlockList<Data, block_size, Storage> leaves;
   BlockList<sjtu::pair<Data, int>, block_size, Storage> heads;
+  // the heads' index as lookups search it, a fresh copy whenever it changes
+  struct TopEntry {
+    Data first;
+    int place;
+  };
+  using Top = std::vector<TopEntry>;
+  using HeadBlock = typename BlockList<sjtu::pair<Data, int>, block_size, Storage>::BlockType;
+  struct Latches {
+    std::shared_mutex root;
+    BlockLatches leaves;
+    // odd while a writer holding the root latch exclusively may move leaves around
+    std::atomic<unsigned> shape{0};
+    std::atomic<const Top*> top{nullptr};
+    // what replaced copies of top wait in until no lookup can be searching them
+    ReaderEpochs epochs;
+    ~Latches() {
+      delete top.load(std::memory_order_relaxed);
+    }
+  };
+  struct Empty {};
+  [[no_unique_address]] std::conditional_t<concurrent, Latches, Empty> latches;
+  using Shared = std::shared_lock<std::shared_mutex>;
+  using Exclusive = std::unique_lock<std::shared_mutex>;
+  // the root latch, in the mode asked for; holds nothing unless concurrent
+  template<typename Lock>
+  Lock lock_root() {
+    if constexpr (concurrent) {
+      return Lock(latches.root);
+    } else {
+      return Lock();
+    }
+  }
+  // The root latch held exclusively, by a writer that may change more than one
+  // leaf. The shape count is odd meanwhile, so that readers holding no latch
+  // learn that what they copied may have moved.
+  class Reshaping {
+   private:
+    BlockBlockList &list;
+    Exclusive root;
+   public:
+    Reshaping(BlockBlockList &list_) : list(list_), root(list.template lock_root<Exclusive>()) {
+      if constexpr (concurrent) {
+        list.latches.shape.store(list.latches.shape.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+      }
+    }
+    Reshaping(const Reshaping &) = delete;
+    Reshaping& operator = (const Reshaping &) = delete;
+    ~Reshaping() {
+      if constexpr (concurrent) {
+        list.publish_top();
+        list.latches.shape.store(list.latches.shape.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+      }
+    }
+  };
  public:
   BlockBlockList(const string_view str) : storage_handler(str.data()), helper(storage_handler),
-      leaves(HEAD_ROOT, storage_handler), heads(2 * HEAD_ROOT, storage_handler) {}
+      leaves(HEAD_ROOT, storage_handler), heads(2 * HEAD_ROOT, storage_handler) {
+    heads.build_index();
+    if constexpr (concurrent) {
+      leaves.latch_with(&latches.leaves);
+      publish_top();
+    }
+  }
+  using Cursor = typename BlockList<Data, block_size, Storage>::Cursor;
+  // Walks the entries from begin through end like Cursor, but takes no latch, so
+  // readers never hold writers up and write no memory other threads use. The
+  // heads are searched in the published copy of their index and then block by
+  // block, each read kept only if the shape of the list did not change meanwhile.
+  // A leaf is copied and the copy kept only if neither its version nor the shape
+  // changed. Else the walk searches again for what follows the last entry it
+  // handed out. While a writer reshapes the list, or if the thread has no reader
+  // epoch slot, the heads are searched under the shared root latch instead.
+  class OptimisticCursor {
+   private:
+    using Leaf = typename BlockList<Data, block_size, Storage>::BlockType;
+    BlockBlockList &list;
+    Data const end;
+    Leaf leaf;
+    HeadBlock head;
+    // the leaf copied, 0 past the end, and what its copy was checked against
+    int place = 0;
+    unsigned version = 0, shape = 0;
+    int i = 0;
+    // where the walk went down last, to go back there if nothing was handed out since
+    Data from;
+    bool after = false;
+    bool same_shape() {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return list.latches.shape.load(std::memory_order_relaxed) == shape;
+    }
+    bool unchanged(int at, unsigned at_version) {
+      return list.latches.leaves.validate(at, at_version) && same_shape();
+    }
+    // finds the leaf from belongs in, and its version, without latches; false if
+    // a writer got in the way
+    bool find_optimistically(int &at, unsigned &at_version) {
+      {
+        ReaderEpochs::Reading reading;
+        if (!reading) return false;
+        shape = list.latches.shape.load(std::memory_order_acquire);
+        if (shape & 1) return false;
+        const Top &top = *list.latches.top.load(std::memory_order_acquire);
+        int l = 0, r = top.size();
+        while (l < r) {
+          int mid = (l + r) / 2;
+          if (from < top[mid].first) {
+            r = mid;
+          } else {
+            l = mid + 1;
+          }
+        }
+        at = top.empty() ? 0 : top[std::max(l - 1, 0)].place;
+      }
+      at_version = 0;
+      // internal blocks of the heads have no prev; the first leaf's is the root slot
+      for (int prev = 0; at && !prev; ) {
+        list.storage_handler.read_at(at, head);
+        if (!same_shape()) return false;
+        at = head.data[std::max(head.upper_bound(from) - 1, 0)].second;
+        list.storage_handler.read_at(at + offsetof(HeadBlock, prev), prev);
+        if (!same_shape()) return false;
+      }
+      if (at) at_version = list.latches.leaves.version(at);
+      return same_shape();
+    }
+    bool copy(int at, unsigned at_version) {
+      if (at_version & 1) return false;
+      list.storage_handler.read_at(at, leaf);
+      if (!unchanged(at, at_version)) return false;
+      place = at;
+      version = at_version;
+      return true;
+    }
+    // copies the leaf x belongs in and stands on the first entry not before x,
+    // or after x if after_ is set
+    void descend(const Data &x, bool after_) {
+      from = x;
+      after = after_;
+      while (true) {
+        int at;
+        unsigned at_version = 0;
+        if (!find_optimistically(at, at_version)) {
+          Shared root(list.latches.root);
+          shape = list.latches.shape.load(std::memory_order_acquire);
+          at = list.find_leaf(from);
+          if (at) at_version = list.latches.leaves.version(at);
+        }
+        if (at == 0) {
+          place = 0;
+          return;
+        }
+        if (copy(at, at_version)) break;
+      }
+      i = after ? leaf.upper_bound(from) : leaf.lower_bound(from);
+    }
+    void settle() {
+      while (place) {
+        if (i < leaf.size) {
+          if (end < leaf[i]) place = 0;
+          return;
+        }
+        if (!leaf.next) {
+          place = 0;
+          return;
+        }
+        int next = leaf.next;
+        Data last = leaf[leaf.size - 1];
+        unsigned next_version = list.latches.leaves.version(next);
+        // while this leaf is as copied, its next still leads to the leaf after it
+        if (unchanged(place, version) && copy(next, next_version)) {
+          i = 0;
+        } else if (after ? from < last : !(last < from)) {
+          descend(last, true);
+        } else {
+          descend(from, after);
+        }
+      }
+    }
+   public:
+    OptimisticCursor(BlockBlockList &list_, const Data &begin, const Data &end_) : list(list_), end(end_) {
+      descend(begin, false);
+      settle();
+    }
+    OptimisticCursor(const OptimisticCursor &) = delete;
+    OptimisticCursor& operator = (const OptimisticCursor &) = delete;
+    explicit operator bool() const {
+      return place != 0;
+    }
+    const Data& operator*() const {
+      return leaf[i];
+    }
+    const Data* operator->() const {
+      return &leaf[i];
+    }
+    OptimisticCursor& operator++() {
+      i++;
+      settle();
+      return *this;
+    }
+  };
+  // the leaf the entries from begin on start in, 0 if there is none
+  template<typename Heads>
+  static int find_leaf(Heads &heads, Storage &storage, const Data &begin) {
+    int place = heads.find_block(begin);
+    if (place == 0) return 0;
+    return typename Heads::AutonomousBlock(storage, place).find(begin);
+  }
+  int find_leaf(const Data &begin) {
+    return find_leaf(heads, storage_handler, begin);
+  }
+  // streams the entries from begin through end; see BlockList::Cursor
+  std::conditional_t<concurrent, OptimisticCursor, Cursor> scan(const Data &begin, const Data &end) {
+    if constexpr (concurrent) {
+      return OptimisticCursor(*this, begin, end);
+    } else {
+      return Cursor(leaves, begin, end, find_leaf(begin));
+    }
+  }
   vector<Data> find(const Data &begin, const Data &end) {
     // std::cerr << "BBL::FIND\n";
-    int place = heads.find_block(begin);
-    if (place == 0) return {};
-    return leaves.find(begin, end, 
-      typename decltype(heads)::AutonomousBlock(storage_handler, place).find(begin));
+    if constexpr (concurrent) {
+      vector<Data> ret{};
+      for (OptimisticCursor cursor(*this, begin, end); cursor; ++cursor) ret.push_back(*cursor);
+      return ret;
+    } else {
+      return leaves.find(begin, end, find_leaf(begin));
+    }
+  }
+  // The list frozen as it was when the snapshot was taken, for long scans that
+  // must neither skip nor repeat entries while writers go on. It reads through a
+  // view of a storage that keeps old versions of the pages, like VersionedStorage,
+  // which holds on to them until the snapshot dies.
+  class Snapshot {
+   private:
+    Storage view;
+    BlockList<Data, block_size, Storage> leaves;
+    BlockList<sjtu::pair<Data, int>, block_size, Storage> heads;
+   public:
+    Snapshot(BlockBlockList &list) : view(list.pin()), leaves(HEAD_ROOT, view), heads(2 * HEAD_ROOT, view) {
+      heads.build_index();
+    }
+    Snapshot(const Snapshot &) = delete;
+    Snapshot& operator = (const Snapshot &) = delete;
+    Cursor scan(const Data &begin, const Data &end) {
+      return Cursor(leaves, begin, end, find_leaf(heads, view, begin));
+    }
+    vector<Data> find(const Data &begin, const Data &end) {
+      return leaves.find(begin, end, find_leaf(heads, view, begin));
+    }
+  };
+  Snapshot snapshot()
+  requires requires (Storage storage) { { storage.snapshot() } -> std::same_as<Storage>; } {
+    return Snapshot(*this);
   }
   void insert(const Data &x) {
+    if constexpr (concurrent) {
+      Shared root(latches.root);
+      if (insert_in_leaf(x)) return;
+    }
+    Reshaping reshaping(*this);
+    insert_exclusive(x);
+  }
+  void erase(const Data &x) {
+    if constexpr (concurrent) {
+      Shared root(latches.root);
+      if (erase_in_leaf(x)) return;
+    }
+    Reshaping reshaping(*this);
+    OperationGuard guard(storage_handler);
+    int place = heads.find_block(x);
+    if (place == 0) return;
+    typename decltype(heads)::AutonomousBlock(heads, place).erase(x);
+  }
+ private:
+  // The insert or erase done to the leaf alone, under the shared root latch and
+  // the leaf's own; false, with nothing done, if it would change anything above
+  // the leaf: a full leaf splits, and a new or erased first entry rekeys the heads.
+  bool insert_in_leaf(const Data &x) {
+    int place = find_leaf(x);
+    if (place == 0) return false;
+    Exclusive latch(latches.leaves[place]);
+    typename decltype(leaves)::AutonomousBlock leaf(storage_handler, place);
+    if (leaf.block.size == static_cast<int>(block_size) || x < leaf.block[0]) return false;
+    BlockLatches::Writing writing(latches.leaves, place);
+    leaf.block.insert(x);
+    storage_handler.write_at(place, leaf.block);
+    return true;
+  }
+  bool erase_in_leaf(const Data &x) {
+    int place = find_leaf(x);
+    if (place == 0) return true;
+    Exclusive latch(latches.leaves[place]);
+    typename decltype(leaves)::AutonomousBlock leaf(storage_handler, place);
+    int i = leaf.block.entry_lower_bound(x);
+    if (i == leaf.block.size || x < leaf.block.data[i]) return true;
+    if (i == 0) return false;
+    BlockLatches::Writing writing(latches.leaves, place);
+    leaf.block.erase(x);
+    storage_handler.write_at(place, leaf.block);
+    return true;
+  }
+  void insert_exclusive(const Data &x) {
     // std::cerr << "BBL::INSERT\n";
+    OperationGuard guard(storage_handler);
     int place = heads.find_block(x);
     if (place == 0) {
       // std::cerr << "BBL::INSERT::place == 0\n";
@@ -47,12 +355,111 @@ class BlockBlockList {
       return;
     }
     // std::cerr << "BBL::INSERT::place != 0\n";
-    typename decltype(heads)::AutonomousBlock(storage_handler, place).insert(x);
+    typename decltype(heads)::AutonomousBlock(heads, place).insert(x);
+    grow();
   }
-  void erase(const Data &x) {
-    int place = heads.find_block(x);
-    if (place == 0) return;
-    typename decltype(heads)::AutonomousBlock(storage_handler, place).erase(x);
+ public:
+  // Sorts the batch and applies it a leaf at a time, so every leaf and head
+  // block it touches is read and written once rather than once per entry.
+  template<typename Iterator>
+  void insert_batch(Iterator first, Iterator last) {
+    std::vector<Data> batch(first, last);
+    std::sort(batch.begin(), batch.end());
+    Reshaping reshaping(*this);
+    OperationGuard guard(storage_handler);
+    const Data *begin = batch.data(), *end = begin + batch.size();
+    while ((begin = heads.apply_runs(begin, end, [] (auto &block, const Data *first, const Data *last,
+                                                      const Data *limit) {
+      return block.insert_run(first, last, limit);
+    })) != end) {
+      insert_exclusive(*begin++);
+    }
+    grow();
+  }
+  template<typename Iterator>
+  void erase_batch(Iterator first, Iterator last) {
+    std::vector<Data> batch(first, last);
+    std::sort(batch.begin(), batch.end());
+    Reshaping reshaping(*this);
+    OperationGuard guard(storage_handler);
+    heads.apply_runs(batch.data(), batch.data() + batch.size(), [] (auto &block, const Data *first,
+                                                                    const Data *last, const Data *limit) {
+      return block.erase_run(first, last, limit);
+    });
+  }
+  // Fills the empty list from [first, last), which has to be in ascending order:
+  // leaves get fill entries each and go out in key order, the heads with them.
+  template<typename Iterator>
+  void bulk_load(Iterator first, Iterator last, int fill = block_size) {
+    load([&] (auto push) {
+      for (; first != last; ++first) push(*first);
+    }, fill);
+  }
+  // the same for input in any order, sorted in runs of at most run_bytes
+  template<typename Iterator>
+  void bulk_load_unsorted(Iterator first, Iterator last, int fill = block_size, size_t run_bytes = 1 << 26) {
+    load([&] (auto push) {
+      external_sort<Data>(first, last, push, run_bytes);
+    }, fill);
+  }
+  // Writes the live data to a new file at target with the leaves packed, fill
+  // entries each, contiguously in key order. Swap the files while neither is open.
+  void compact(const string_view target, int fill = block_size) {
+    Shared root = lock_root<Shared>();
+    BlockBlockList result(target);
+    result.load([&] (auto push) {
+      leaves.for_each(push);
+    }, fill);
+  }
+ private:
+  // Copies the heads' index for lookups if it changed, under the exclusive root
+  // latch. A replaced copy is freed once no lookup can still be searching it.
+  void publish_top() {
+    const Top *old = latches.top.load(std::memory_order_relaxed);
+    size_t i = 0;
+    bool same = old != nullptr;
+    heads.for_each_indexed([&] (const Data &first, int place) {
+      same = same && i < old->size() && (*old)[i].place == place &&
+             !((*old)[i].first < first) && !(first < (*old)[i].first);
+      i++;
+    });
+    if (same && i == old->size()) return;
+    Top *top = new Top();
+    top->reserve(i);
+    heads.for_each_indexed([&] (const Data &first, int place) {
+      top->push_back(TopEntry{first, place});
+    });
+    latches.top.store(top, std::memory_order_release);
+    if (old) latches.epochs.retire([old] { delete old; });
+  }
+  // A view of the storage as it is now. The storage cannot tell whether a write
+  // is under way while it pins the view, so holding the root latch exclusively
+  // is what keeps every writer, in-leaf ones included, out meanwhile.
+  Storage pin() {
+    Exclusive root = lock_root<Exclusive>();
+    return storage_handler.snapshot();
+  }
+  // The heads chain is the top level; the blocks under it are internal nodes
+  // (prev == 0) down to the leaves. The top is found through the in-memory index
+  // and costs no reads, so it may run to block_size blocks; past that its blocks
+  // move a level down under a new top, which bounds both the index and the reads.
+  void grow() {
+    while (heads.chain_length() > static_cast<int>(block_size)) heads.raise();
+  }
+  // feed is called once with a function taking the entries in ascending order
+  template<typename Feed>
+  void load(Feed feed, int fill) {
+    Reshaping reshaping(*this);
+    {
+      typename decltype(leaves)::Appender leaves_out(leaves, fill);
+      typename decltype(heads)::Appender heads_out(heads);
+      feed([&] (const Data &x) {
+        if (int place = leaves_out.push(x)) {
+          heads_out.push(sjtu::pair<Data, int>(x, place));
+        }
+      });
+    }
+    grow();
   }
 };
 
@@ -0,0 +1,64 @@
+#pragma once
+
+#ifndef BPT_EXTERNAL_SORT_
+#define BPT_EXTERNAL_SORT_
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <queue>
+#include <type_traits>
+#include <vector>
+#include "exceptions.hpp"
+
+// Hands everything [first, last) yields to output in ascending order. At most
+// run_bytes of it is held in memory; longer input is cut into sorted runs that
+// go to temporary files and are merged back in a single pass.
+template<typename Data, typename Iterator, typename Output>
+requires std::is_trivially_copyable<Data>::value
+void external_sort(Iterator first, Iterator last, Output output, size_t run_bytes = 1 << 26) {
+  const size_t run_size = std::max<size_t>(1, run_bytes / sizeof(Data));
+  std::vector<Data> buffer;
+  struct Run {
+    FILE *file;
+    ~Run() {
+      if (file) std::fclose(file);
+    }
+  };
+  std::vector<std::unique_ptr<Run>> runs;
+  while (first != last) {
+    buffer.clear();
+    for (; first != last && buffer.size() < run_size; ++first) buffer.push_back(*first);
+    std::sort(buffer.begin(), buffer.end());
+    if (first == last && runs.empty()) break;
+    runs.push_back(std::unique_ptr<Run>(new Run{std::tmpfile()}));
+    FILE *file = runs.back()->file;
+    if (!file || std::fwrite(buffer.data(), sizeof(Data), buffer.size(), file) != buffer.size()) {
+      throw sjtu::runtime_error();
+    }
+    std::rewind(file);
+  }
+  if (runs.empty()) {
+    for (const Data &x : buffer) output(x);
+    return;
+  }
+  buffer = std::vector<Data>();
+  struct Head {
+    Data value;
+    size_t run;
+  };
+  auto later = [] (const Head &x, const Head &y) { return y.value < x.value; };
+  std::priority_queue<Head, std::vector<Head>, decltype(later)> heads(later);
+  Head head;
+  for (size_t i = 0; i < runs.size(); i++) {
+    if (std::fread(&head.value, sizeof(Data), 1, runs[i]->file) == 1) heads.push(Head{head.value, i});
+  }
+  while (!heads.empty()) {
+    head = heads.top();
+    heads.pop();
+    output(head.value);
+    if (std::fread(&head.value, sizeof(Data), 1, runs[head.run]->file) == 1) heads.push(head);
+  }
+}
+
+#endif
@@ -3,96 +3,1022 @@
 #ifndef BPT_FILE_
 #define BPT_FILE_
 
-#include <fstream>
+#include <atomic>
 #include <memory>
+#include <concepts>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <climits>
+#include <cstdint>
+#include <initializer_list>
+#include <functional>
+#include <vector>
+#include <cerrno>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
 #include "vector.hpp"
-using std::ifstream, std::ofstream, std::fstream;
+#include "exceptions.hpp"
 using sjtu::vector;
 
+// The unit the kernel caches and O_DIRECT transfers files in. Blocks that take
+// whole pages and start on a page boundary are read and written a page at a time.
+constexpr size_t PAGE_BYTES = 4096;
+
+// The first page of a file that is kept longer than the data in it, which starts
+// on the next page. size is the logical end of that data.
+struct FileHeader {
+  static constexpr unsigned MAGIC = 0x31545042;
+  unsigned magic;
+  int size;
+  bool valid() const {
+    return magic == MAGIC && size >= 0;
+  }
+};
+
+// One extent of a batched write or read.
+struct WriteRequest {
+  int place;
+  const char *value;
+  size_t bytes;
+  WriteRequest(int place_, const char *value_, size_t bytes_) : place(place_), value(value_), bytes(bytes_) {}
+  template<typename T> requires std::is_trivially_copyable<T>::value
+  WriteRequest(int place_, const T &value_) :
+      place(place_), value(reinterpret_cast<const char*>(&value_)), bytes(sizeof(T)) {}
+};
+
+struct ReadRequest {
+  int place;
+  char *value;
+  size_t bytes;
+  ReadRequest(int place_, char *value_, size_t bytes_) : place(place_), value(value_), bytes(bytes_) {}
+  template<typename T> requires std::is_trivially_copyable<T>::value
+  ReadRequest(int place_, T &value_) :
+      place(place_), value(reinterpret_cast<char*>(&value_)), bytes(sizeof(T)) {}
+};
+
+// Common helpers of every storage backend. Derived is the backend itself, so that
+// read_at/write_at resolve to its read/write at compile time and can be inlined.
+template<typename Derived>
 class BasicStorage {
  protected:
   bool initialized_;
+ private:
+  // Released extents of one size are chained through their first int; the head of
+  // the chain lives at slot, inside the file, so it survives reopening.
+  struct FreeList {
+    size_t bytes;
+    int slot;
+  };
+  std::shared_ptr<vector<FreeList>> free_lists_;
+  Derived& derived() { return static_cast<Derived&>(*this); }
+  FreeList* free_list(size_t bytes) {
+    for (size_t i = 0; i < free_lists_->size(); i++) {
+      if ((*free_lists_)[i].bytes == bytes) return &(*free_lists_)[i];
+    }
+    return nullptr;
+  }
  public:
   BasicStorage() = delete;
-  BasicStorage(const char *name) : initialized_(false) {}
+  BasicStorage(const char *name) : initialized_(false), free_lists_(std::make_shared<vector<FreeList>>()) {}
   BasicStorage(const BasicStorage &other) = default;
   BasicStorage(BasicStorage &&other) = default;
   ~BasicStorage() = default;
   BasicStorage& operator = (const BasicStorage &) = delete;
   BasicStorage& operator = (BasicStorage &&) = delete;
-  virtual void write(int place, const char *value, size_t bytes) = 0;
-  virtual void read(int place, char *value, size_t bytes) = 0;
-  virtual int file_size() = 0;
+  void write_vector(const WriteRequest *requests, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+      derived().write(requests[i].place, requests[i].value, requests[i].bytes);
+    }
+  }
+  void read_vector(const ReadRequest *requests, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+      derived().read(requests[i].place, requests[i].value, requests[i].bytes);
+    }
+  }
+  void write_batch(std::initializer_list<WriteRequest> requests) {
+    derived().write_vector(requests.begin(), requests.size());
+  }
+  void read_batch(std::initializer_list<ReadRequest> requests) {
+    derived().read_vector(requests.begin(), requests.size());
+  }
   template<typename T> requires std::is_trivially_copyable<T>::value
   void write_at(int place, const T& value) {
-    write(place, reinterpret_cast<const char*>(&value), sizeof(T));
+    derived().write(place, reinterpret_cast<const char*>(&value), sizeof(T));
   }
   template<typename T> requires std::is_trivially_copyable<T>::value
   void read_at(int place, T& value) {
-    read(place, reinterpret_cast<char*>(&value), sizeof(T));
+    derived().read(place, reinterpret_cast<char*>(&value), sizeof(T));
   }
   template<typename T, std::size_t N> requires std::is_trivially_copyable<T>::value
   void write_at(int place, const T (&value)[N]) {
-    write(place, reinterpret_cast<const char*>(value), sizeof(value));
+    derived().write(place, reinterpret_cast<const char*>(value), sizeof(value));
   }
   template<typename T, std::size_t N> requires std::is_trivially_copyable<T>::value
   void read_at(int place, T (&value)[N]) {
-    read(place, reinterpret_cast<char*>(value), sizeof(value));
+    derived().read(place, reinterpret_cast<char*>(value), sizeof(value));
   }
+  // Hands out bytes of space, reusing a released extent of the same size if one is
+  // tracked. Every backend tracks its logical end in memory, so growing the file
+  // never has to ask it how big it is. New extents start at a multiple of
+  // alignment; the gap before them is left unused, and as long as an extent size
+  // is always asked for with the same alignment, reused ones keep it too.
+  int allocate(size_t bytes, size_t alignment = 1) {
+    if (FreeList *list = free_list(bytes)) {
+      int head;
+      read_at(list->slot, head);
+      if (head) {
+        int next;
+        read_at(head, next);
+        write_at(list->slot, next);
+        return head;
+      }
+    }
+    if (size_t gap = (alignment - derived().file_size() % alignment) % alignment) derived().extend(gap);
+    return derived().extend(bytes);
+  }
+  // Gives an extent back for reuse. Sizes nobody tracks are simply leaked.
+  void release(int place, size_t bytes) {
+    if (FreeList *list = free_list(bytes)) {
+      int head;
+      read_at(list->slot, head);
+      write_batch({WriteRequest(place, head), WriteRequest(list->slot, place)});
+    }
+  }
+  // Starts recycling extents of the given size through the chain headed at slot.
+  // The first registration of a size wins; lists of equal-sized blocks share it.
+  void track_free_blocks(size_t bytes, int slot) {
+    if (free_list(bytes) == nullptr) free_lists_->push_back({bytes, slot});
+  }
+  // Brackets one logical update of a container; nested brackets count as one. Only
+  // storages that group updates into transactions care.
+  void begin_operation() {}
+  void end_operation() {}
+  // Makes everything written so far durable.
+  void sync() {}
+  // Hints that [place, place + bytes) is about to be read, so that storages
+  // backed by a file can start fetching it in the background.
+  void prefetch(int, size_t) {}
   bool& initialized() { return initialized_; }
 };
 
-class VectorStorage : public BasicStorage {
+template<typename Storage>
+class OperationGuard {
+ private:
+  Storage &storage;
+ public:
+  OperationGuard(Storage &storage_) : storage(storage_) {
+    storage.begin_operation();
+  }
+  OperationGuard(const OperationGuard &) = delete;
+  OperationGuard& operator = (const OperationGuard &) = delete;
+  ~OperationGuard() {
+    storage.end_operation();
+  }
+};
+
+// What BlockList and friends expect from a storage: cheap copies sharing one
+// underlying file, opened by name, with byte-addressed reads and writes.
+template<typename S>
+concept random_access_storage = std::constructible_from<S, const char*> && std::copy_constructible<S> &&
+    requires (S storage, int place, char *buffer, const char *value, size_t bytes,
+              const WriteRequest *writes, const ReadRequest *reads, int integer) {
+  storage.write(place, value, bytes);
+  storage.read(place, buffer, bytes);
+  { storage.file_size() } -> std::convertible_to<int>;
+  { storage.allocate(bytes) } -> std::convertible_to<int>;
+  storage.release(place, bytes);
+  storage.track_free_blocks(bytes, place);
+  storage.begin_operation();
+  storage.end_operation();
+  storage.sync();
+  storage.write_vector(writes, bytes);
+  storage.read_vector(reads, bytes);
+  storage.write_at(place, integer);
+  storage.read_at(place, integer);
+  { storage.initialized() } -> std::same_as<bool&>;
+};
+
+class VectorStorage : public BasicStorage<VectorStorage> {
  private:
   std::shared_ptr<vector<char>> data;
  public:
   VectorStorage(const char *name) : BasicStorage(name), data(std::make_shared<vector<char>>()) {}
   VectorStorage(const VectorStorage &other) = default;
   VectorStorage(VectorStorage &&other) = default;
-  void write(int place, const char *value, size_t bytes) override {
+  void write(int place, const char *value, size_t bytes) {
     if (data->size() < place + bytes) {
       data->resize(place + bytes);
     }
-    for (int i = 0; i < bytes; i++) {
-      data->operator[](place + i) = value[i];
-    }
+    std::memcpy(&data->operator[](place), value, bytes);
   }
-  void read(int place, char *value, size_t bytes) override {
-    for (int i = 0; i < bytes; i++) {
-      value[i] = data->operator[](place + i);
-    }
+  void read(int place, char *value, size_t bytes) {
+    std::memcpy(value, &data->operator[](place), bytes);
   }
-  int file_size() override {
+  int file_size() {
     return data->size();
   }
+  int extend(size_t bytes) {
+    int place = data->size();
+    data->resize(place + bytes);
+    return place;
+  }
 };
 
-class FileStorage : public BasicStorage {
+// Opens name for reading and writing, creating it empty if it is missing. Sets
+// existed to whether it was there already and size to its length in bytes.
+inline int open_file(const char *name, bool &existed, off_t &size) {
+  int fd = ::open(name, O_RDWR);
+  existed = fd != -1;
+  if (fd == -1) fd = ::open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) throw sjtu::runtime_error();
+  struct stat st;
+  if (::fstat(fd, &st) == -1) {
+    ::close(fd);
+    throw sjtu::runtime_error();
+  }
+  size = st.st_size;
+  return fd;
+}
+
+// A raw descriptor read and written at explicit offsets with pread/pwrite. A call
+// leaves nothing behind but, for a write past the end, the grown size, which is
+// kept in an atomic, so copies share no file position and concurrent readers
+// and writers need no lock.
+class FileStorage : public BasicStorage<FileStorage> {
  private:
-  std::shared_ptr<fstream> file;
- public:
-  FileStorage(const char *name) : BasicStorage(name), file(new fstream) {
-    file->open(name, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
-    if (file->is_open()) {
-      initialized_ = true;
-    } else {
-      file->open(name, std::ios_base::in | std::ios_base::out | std::ios_base::trunc | std::ios::binary);
+  struct Handle {
+    int fd = -1;
+    std::atomic<int> size{0};
+    ~Handle() {
+      if (fd != -1) ::close(fd);
+    }
+    // raises size to end unless it is there already, so rewrites store nothing
+    void grow_to(int end) {
+      int current = size.load(std::memory_order_relaxed);
+      while (current < end && !size.compare_exchange_weak(current, end, std::memory_order_relaxed)) {}
+    }
+  };
+  std::shared_ptr<Handle> file;
+  // Sorts the extents by place and issues one preadv/pwritev per contiguous run.
+  // Like read(), a run that comes back short is asked for again from where it
+  // stopped, and reading leaves zeros in what lies past the end of the file.
+  template<typename Request, typename Syscall>
+  void vectored(const Request *requests, size_t count, Syscall syscall, bool reading) {
+    const Request *local[16];
+    vector<const Request*> heap;
+    const Request **sorted = local;
+    if (count > 16) {
+      heap.resize(count);
+      sorted = &heap[0];
+    }
+    for (size_t i = 0; i < count; i++) {
+      sorted[i] = requests + i;
+    }
+    for (size_t i = 1; i < count; i++) {
+      for (size_t j = i; j > 0 && sorted[j]->place < sorted[j - 1]->place; j--) {
+        std::swap(sorted[j], sorted[j - 1]);
+      }
     }
+    iovec iov[IOV_MAX];
+    for (size_t i = 0; i < count; ) {
+      int begin = sorted[i]->place, end = begin;
+      int n = 0;
+      while (i < count && n < IOV_MAX && sorted[i]->place == end) {
+        iov[n++] = {const_cast<char*>(sorted[i]->value), sorted[i]->bytes};
+        end += sorted[i]->bytes;
+        i++;
+      }
+      iovec *rest = iov;
+      size_t done = 0;
+      while (true) {
+        for (; n > 0 && done >= rest->iov_len; rest++, n--) done -= rest->iov_len;
+        if (n == 0) break;
+        rest->iov_base = static_cast<char*>(rest->iov_base) + done;
+        rest->iov_len -= done;
+        ssize_t result = syscall(file->fd, rest, n, begin);
+        if (result < 0) {
+          if (errno == EINTR) continue;
+          throw sjtu::runtime_error();
+        }
+        if (result == 0) {
+          if (!reading) throw sjtu::runtime_error();
+          for (; n > 0; rest++, n--) std::memset(rest->iov_base, 0, rest->iov_len);
+          break;
+        }
+        begin += result;
+        done = result;
+      }
+    }
+  }
+ public:
+  FileStorage(const char *name) : BasicStorage(name), file(std::make_shared<Handle>()) {
+    off_t size;
+    file->fd = open_file(name, initialized_, size);
+    file->size = size;
   }
   FileStorage(const FileStorage &) = default;
   FileStorage(FileStorage &&) = default;
   ~FileStorage() = default;
-  void write(int place, const char *value, size_t bytes) override {
-    file->seekp(place);
-    file->write(value, bytes);
+  void write(int place, const char *value, size_t bytes) {
+    if (::pwrite(file->fd, value, bytes, place) != static_cast<ssize_t>(bytes)) throw sjtu::runtime_error();
+    file->grow_to(place + bytes);
+  }
+  // A read comes back short at the end of the file, past which it reads as zeros,
+  // or when it was interrupted, and then the rest is asked for again.
+  void read(int place, char *value, size_t bytes) {
+    while (bytes > 0) {
+      ssize_t result = ::pread(file->fd, value, bytes, place);
+      if (result < 0) {
+        if (errno == EINTR) continue;
+        throw sjtu::runtime_error();
+      }
+      if (result == 0) {
+        std::memset(value, 0, bytes);
+        return;
+      }
+      place += result;
+      value += result;
+      bytes -= result;
+    }
+  }
+  int file_size() {
+    return file->size.load(std::memory_order_relaxed);
+  }
+  int extend(size_t bytes) {
+    return file->size.fetch_add(bytes, std::memory_order_relaxed);
+  }
+  void write_vector(const WriteRequest *requests, size_t count) {
+    vectored(requests, count, ::pwritev, false);
+    for (size_t i = 0; i < count; i++) {
+      file->grow_to(requests[i].place + requests[i].bytes);
+    }
+  }
+  void sync() {
+    if (::fsync(file->fd) == -1) throw sjtu::runtime_error();
+  }
+  // queues a read into the page cache; only a hint, so failures are ignored
+  void prefetch(int place, size_t bytes) {
+    ::posix_fadvise(file->fd, place, bytes, POSIX_FADV_WILLNEED);
+  }
+  void read_vector(const ReadRequest *requests, size_t count) {
+    vectored(requests, count, ::preadv, true);
+  }
+};
+
+// Reads and writes the file with O_DIRECT, around the kernel page cache, so the
+// process alone decides what stays resident: put a BufferPoolStorage in front of
+// it to cache pages. Transfers are whole PAGE_BYTES pages from page-aligned
+// memory. Requests that are aligned already go straight through; others go through
+// a bounce buffer, reading first the pages they only partly cover. Where the file
+// system refuses O_DIRECT the file is used through the cache and direct() is false.
+// As whole pages are written the file runs past its logical size, so that is kept
+// in a FileHeader on the first page, written by sync() and when the last copy
+// dies; a file left by a crash reopens with the size of its last sync. Files not
+// started by DirectStorage are refused.
+class DirectStorage : public BasicStorage<DirectStorage> {
+ public:
+  // pages that went to and from the disk without taking up page cache
+  struct Statistics {
+    long long pages_read, pages_written;
+  };
+ private:
+  struct Handle {
+    int fd = -1;
+    int size = 0;
+    bool direct = false;
+    char *buffer = nullptr;
+    size_t capacity = 0;
+    Statistics statistics{};
+    ~Handle() {
+      std::free(buffer);
+      if (fd == -1) return;
+      if (write_header()) {
+        // whole pages were written, so the tail beyond size is cut off again
+        if (::ftruncate(fd, PAGE_BYTES + size) == -1) {
+          // past size the file holds nothing, so a failed trim only wastes space
+        }
+      }
+      ::close(fd);
+    }
+    bool write_header() {
+      alignas(PAGE_BYTES) char page[PAGE_BYTES] = {};
+      *reinterpret_cast<FileHeader*>(page) = FileHeader{FileHeader::MAGIC, size};
+      return ::pwrite(fd, page, PAGE_BYTES, 0) == static_cast<ssize_t>(PAGE_BYTES);
+    }
+    void read_header() {
+      alignas(PAGE_BYTES) char page[PAGE_BYTES];
+      const FileHeader &header = *reinterpret_cast<const FileHeader*>(page);
+      if (::pread(fd, page, PAGE_BYTES, 0) != static_cast<ssize_t>(PAGE_BYTES) || !header.valid()) {
+        // not a file of ours, so leave it as it is
+        ::close(fd);
+        fd = -1;
+        throw sjtu::runtime_error();
+      }
+      size = header.size;
+    }
+    char *bounce(size_t bytes) {
+      if (bytes > capacity) {
+        std::free(buffer);
+        buffer = static_cast<char*>(std::aligned_alloc(PAGE_BYTES, bytes));
+        capacity = buffer == nullptr ? 0 : bytes;
+        if (buffer == nullptr) throw sjtu::runtime_error();
+      }
+      return buffer;
+    }
+    // [begin, end) of the data is page-aligned; what lies past the end of the file
+    // reads as zeros
+    void read_pages(int begin, int end, char *to) {
+      ssize_t bytes = ::pread(fd, to, end - begin, PAGE_BYTES + begin);
+      if (bytes < 0) throw sjtu::runtime_error();
+      std::memset(to + bytes, 0, end - begin - bytes);
+      if (direct) statistics.pages_read += (end - begin) / PAGE_BYTES;
+    }
+    void write_pages(int begin, int end, const char *from) {
+      if (::pwrite(fd, from, end - begin, PAGE_BYTES + begin) != end - begin) throw sjtu::runtime_error();
+      if (direct) statistics.pages_written += (end - begin) / PAGE_BYTES;
+    }
+  };
+  std::shared_ptr<Handle> file;
+  static bool aligned(int place, const char *value, size_t bytes) {
+    return place % PAGE_BYTES == 0 && bytes % PAGE_BYTES == 0 &&
+           reinterpret_cast<uintptr_t>(value) % PAGE_BYTES == 0;
+  }
+ public:
+  DirectStorage(const char *name) : BasicStorage(name), file(std::make_shared<Handle>()) {
+    off_t length;
+    file->fd = open_file(name, initialized_, length);
+    file->direct = ::fcntl(file->fd, F_SETFL, O_DIRECT) == 0;
+    if (length == 0) {
+      if (!file->write_header()) throw sjtu::runtime_error();
+    } else {
+      file->read_header();
+    }
+  }
+  DirectStorage(const DirectStorage &) = default;
+  DirectStorage(DirectStorage &&) = default;
+  ~DirectStorage() = default;
+  void write(int place, const char *value, size_t bytes) {
+    file->size = std::max(file->size, static_cast<int>(place + bytes));
+    if (aligned(place, value, bytes)) {
+      file->write_pages(place, place + bytes, value);
+      return;
+    }
+    int begin = place / PAGE_BYTES * PAGE_BYTES;
+    int end = (place + bytes + PAGE_BYTES - 1) / PAGE_BYTES * PAGE_BYTES;
+    char *buffer = file->bounce(end - begin);
+    if (place != begin) file->read_pages(begin, begin + PAGE_BYTES, buffer);
+    if ((place + bytes) % PAGE_BYTES && (place == begin || end - begin > static_cast<int>(PAGE_BYTES))) {
+      file->read_pages(end - PAGE_BYTES, end, buffer + (end - PAGE_BYTES - begin));
+    }
+    std::memcpy(buffer + (place - begin), value, bytes);
+    file->write_pages(begin, end, buffer);
+  }
+  void read(int place, char *value, size_t bytes) {
+    if (aligned(place, value, bytes)) {
+      file->read_pages(place, place + bytes, value);
+      return;
+    }
+    int begin = place / PAGE_BYTES * PAGE_BYTES;
+    int end = (place + bytes + PAGE_BYTES - 1) / PAGE_BYTES * PAGE_BYTES;
+    char *buffer = file->bounce(end - begin);
+    file->read_pages(begin, end, buffer);
+    std::memcpy(value, buffer + (place - begin), bytes);
+  }
+  int file_size() {
+    return file->size;
   }
-  void read(int place, char *value, size_t bytes) override {
-    file->seekp(place);
-    file->read(value, bytes);
+  int extend(size_t bytes) {
+    int place = file->size;
+    file->size += bytes;
+    return place;
+  }
+  void sync() {
+    if (!file->write_header() || ::fsync(file->fd) == -1) throw sjtu::runtime_error();
+  }
+  bool direct() const {
+    return file->direct;
+  }
+  const Statistics& statistics() const {
+    return file->statistics;
+  }
+};
+
+// Drives the file through an io_uring. Requests queue up in the submission ring
+// and reach the kernel together: when the ring fills up, when submit() is called,
+// or when something has to wait. Callers may keep up to queue_depth of them in
+// flight with submit_read/submit_write; a buffer belongs to the kernel until
+// its callback ran with the bytes transferred, or -errno. The synchronous calls
+// wait for everything in flight first, so they never overtake an earlier request,
+// and a batch goes in as one submission. If the kernel has no io_uring to offer,
+// every request is carried out on the spot and its callback runs right away.
+template<int queue_depth = 64>
+requires (queue_depth > 0 && queue_depth <= 4096)
+class UringStorage : public BasicStorage<UringStorage<queue_depth>> {
+ public:
+  using Callback = std::function<void(int)>;
+ private:
+  struct Ring {
+    int fd = -1;
+    void *sq_map = MAP_FAILED, *cq_map = MAP_FAILED;
+    size_t sq_bytes = 0, cq_bytes = 0;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe *sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    io_uring_cqe *cqes;
+    unsigned entries = 0, queued = 0, in_flight = 0;
+    // callbacks of the requests in flight, by the user_data of their entries
+    std::vector<Callback> callbacks;
+    std::vector<unsigned> free_slots;
+    // left without a ring unless wanted
+    Ring(bool wanted) {
+      if (!wanted) return;
+      io_uring_params params;
+      std::memset(&params, 0, sizeof(params));
+      fd = ::syscall(__NR_io_uring_setup, queue_depth, &params);
+      if (fd == -1) return;
+      // plain reads and writes at an offset came with this feature
+      if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        ::close(fd);
+        fd = -1;
+        return;
+      }
+      sq_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+      cq_bytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      if (params.features & IORING_FEAT_SINGLE_MMAP) sq_bytes = cq_bytes = std::max(sq_bytes, cq_bytes);
+      sq_map = ::mmap(nullptr, sq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+      if (sq_map == MAP_FAILED) throw sjtu::runtime_error();
+      cq_map = params.features & IORING_FEAT_SINGLE_MMAP ? sq_map :
+          ::mmap(nullptr, cq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+      if (cq_map == MAP_FAILED) throw sjtu::runtime_error();
+      sqes = static_cast<io_uring_sqe*>(::mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe),
+          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+      if (sqes == MAP_FAILED) throw sjtu::runtime_error();
+      char *sq = static_cast<char*>(sq_map), *cq = static_cast<char*>(cq_map);
+      sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+      sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+      sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+      sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+      cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+      cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+      cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+      cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+      entries = params.sq_entries;
+    }
+    Ring(const Ring &) = delete;
+    Ring& operator = (const Ring &) = delete;
+    ~Ring() {
+      if (fd == -1) return;
+      if (sqes != MAP_FAILED) ::munmap(sqes, entries * sizeof(io_uring_sqe));
+      if (cq_map != MAP_FAILED && cq_map != sq_map) ::munmap(cq_map, cq_bytes);
+      if (sq_map != MAP_FAILED) ::munmap(sq_map, sq_bytes);
+      ::close(fd);
+    }
+    // hands the queued entries to the kernel and waits until wait_for completed
+    void enter(unsigned wait_for) {
+      while (queued > 0 || wait_for > 0) {
+        int ret = ::syscall(__NR_io_uring_enter, fd, queued, wait_for, wait_for ? IORING_ENTER_GETEVENTS : 0,
+                            nullptr, 0);
+        if (ret < 0) {
+          if (errno == EINTR) continue;
+          throw sjtu::runtime_error();
+        }
+        queued -= ret;
+        if (queued == 0) return;
+      }
+    }
+    // runs the callbacks of the completed requests; returns how many there were
+    int reap() {
+      unsigned head = *cq_head, tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+      int count = 0;
+      for (; head != tail; head++, count++) {
+        const io_uring_cqe &cqe = cqes[head & *cq_mask];
+        unsigned slot = cqe.user_data;
+        int result = cqe.res;
+        Callback callback = std::move(callbacks[slot]);
+        free_slots.push_back(slot);
+        in_flight--;
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        if (callback) callback(result);
+      }
+      return count;
+    }
+    void push(int opcode, int file, int place, const char *buffer, size_t bytes, Callback callback) {
+      // the completion ring holds twice the entries, so this many in flight never overflow it
+      while (in_flight >= entries) {
+        if (reap() == 0) enter(1);
+      }
+      if (*sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == entries) enter(0);
+      unsigned slot;
+      if (free_slots.empty()) {
+        slot = callbacks.size();
+        callbacks.emplace_back();
+      } else {
+        slot = free_slots.back();
+        free_slots.pop_back();
+      }
+      callbacks[slot] = std::move(callback);
+      unsigned tail = *sq_tail, index = tail & *sq_mask;
+      io_uring_sqe &sqe = sqes[index];
+      std::memset(&sqe, 0, sizeof(sqe));
+      sqe.opcode = opcode;
+      sqe.fd = file;
+      sqe.off = place;
+      sqe.addr = reinterpret_cast<uintptr_t>(buffer);
+      sqe.len = bytes;
+      sqe.user_data = slot;
+      sq_array[index] = index;
+      __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+      queued++;
+      in_flight++;
+    }
+  };
+  struct Handle {
+    int fd = -1;
+    int size = 0;
+    Ring ring;
+    Handle(bool ring_wanted) : ring(ring_wanted) {}
+    ~Handle() {
+      // the kernel may still be writing from buffers of requests nobody waited for
+      while (ring.fd != -1 && ring.in_flight > 0) {
+        ring.enter(1);
+        ring.reap();
+      }
+      if (fd != -1) ::close(fd);
+    }
+  };
+  std::shared_ptr<Handle> file;
+  void queue(int opcode, int place, const char *buffer, size_t bytes, Callback callback) {
+    if (file->ring.fd == -1) {
+      ssize_t result = opcode == IORING_OP_READ ?
+          ::pread(file->fd, const_cast<char*>(buffer), bytes, place) : ::pwrite(file->fd, buffer, bytes, place);
+      if (callback) callback(result < 0 ? -errno : result);
+      return;
+    }
+    file->ring.push(opcode, file->fd, place, buffer, bytes, std::move(callback));
+  }
+  // a synchronous read comes back short only at the end of the file, which reads as zeros
+  Callback read_into(char *value, size_t bytes) {
+    return [value, bytes] (int result) {
+      if (result < 0) throw sjtu::runtime_error();
+      std::memset(value + result, 0, bytes - result);
+    };
+  }
+  static void check_written(size_t bytes, int result) {
+    if (result < 0 || static_cast<size_t>(result) != bytes) throw sjtu::runtime_error();
+  }
+ public:
+  // Without ring every request is carried out on the spot, as where the kernel
+  // has no io_uring to offer.
+  UringStorage(const char *name, bool ring = true) : BasicStorage<UringStorage>(name),
+      file(std::make_shared<Handle>(ring)) {
+    off_t size;
+    file->fd = open_file(name, this->initialized_, size);
+    file->size = size;
+  }
+  UringStorage(const UringStorage &) = default;
+  UringStorage(UringStorage &&) = default;
+  ~UringStorage() = default;
+  void submit_read(int place, char *buffer, size_t bytes, Callback callback) {
+    queue(IORING_OP_READ, place, buffer, bytes, std::move(callback));
+  }
+  void submit_write(int place, const char *buffer, size_t bytes, Callback callback) {
+    file->size = std::max(file->size, static_cast<int>(place + bytes));
+    queue(IORING_OP_WRITE, place, buffer, bytes, std::move(callback));
+  }
+  // starts whatever is queued without waiting for it
+  void submit() {
+    if (file->ring.fd != -1) file->ring.enter(0);
+  }
+  // waits for at least one request to finish, if any is in flight, and runs the
+  // callbacks of all that did
+  void complete() {
+    Ring &ring = file->ring;
+    if (ring.fd == -1 || ring.in_flight == 0) return;
+    if (ring.reap() == 0) {
+      ring.enter(1);
+      ring.reap();
+    }
+  }
+  // waits for every request in flight
+  void drain() {
+    while (file->ring.fd != -1 && file->ring.in_flight > 0) complete();
+  }
+  bool asynchronous() const {
+    return file->ring.fd != -1;
+  }
+  void write(int place, const char *value, size_t bytes) {
+    drain();
+    submit_write(place, value, bytes, [bytes] (int result) { check_written(bytes, result); });
+    drain();
+  }
+  void read(int place, char *value, size_t bytes) {
+    drain();
+    submit_read(place, value, bytes, read_into(value, bytes));
+    drain();
+  }
+  void write_vector(const WriteRequest *requests, size_t count) {
+    drain();
+    for (size_t i = 0; i < count; i++) {
+      size_t bytes = requests[i].bytes;
+      submit_write(requests[i].place, requests[i].value, bytes, [bytes] (int result) { check_written(bytes, result); });
+    }
+    drain();
+  }
+  void read_vector(const ReadRequest *requests, size_t count) {
+    drain();
+    for (size_t i = 0; i < count; i++) {
+      submit_read(requests[i].place, requests[i].value, requests[i].bytes,
+                  read_into(requests[i].value, requests[i].bytes));
+    }
+    drain();
+  }
+  int file_size() {
+    return file->size;
+  }
+  int extend(size_t bytes) {
+    int place = file->size;
+    file->size += bytes;
+    return place;
+  }
+  void sync() {
+    drain();
+    if (::fsync(file->fd) == -1) throw sjtu::runtime_error();
+  }
+  void prefetch(int place, size_t bytes) {
+    ::posix_fadvise(file->fd, place, bytes, POSIX_FADV_WILLNEED);
+  }
+};
+
+// Maps the whole file into memory. The mapping grows by whole extents and the
+// file is cut back to its logical size when the last copy is destroyed. Until
+// then the file is longer than the data in it, so the logical size is kept in a
+// FileHeader on the first page, updated in the mapping by every write that grows
+// it; a file left padded by a crash reopens with the size that was last written
+// there. Files not started by MmapStorage are refused.
+// Pointers returned by view_at() are invalidated by any write that grows the file.
+template<int extent_size = (1 << 24)>
+requires (extent_size > 0 && extent_size % 4096 == 0)
+class MmapStorage : public BasicStorage<MmapStorage<extent_size>> {
+ private:
+  struct Mapping {
+    int fd, size;
+    // bytes mapped past the header page
+    size_t capacity;
+    // the mapping, and the data after its header page
+    char *base, *data;
+    Mapping(const char *name, bool &initialized) : capacity(0), base(nullptr), data(nullptr) {
+      off_t length;
+      fd = open_file(name, initialized, length);
+      if (length == 0) {
+        reserve(1);
+        header()->magic = FileHeader::MAGIC;
+        resize(0);
+        return;
+      }
+      FileHeader header;
+      if (::pread(fd, &header, sizeof(header), 0) != sizeof(header) || !header.valid()) {
+        ::close(fd);
+        throw sjtu::runtime_error();
+      }
+      size = header.size;
+      reserve(std::max<size_t>(size, 1));
+    }
+    Mapping(const Mapping &) = delete;
+    Mapping& operator = (const Mapping &) = delete;
+    ~Mapping() {
+      if (base != nullptr) ::munmap(base, PAGE_BYTES + capacity);
+      if (::ftruncate(fd, PAGE_BYTES + size) == -1) {
+        // the tail beyond size is zero-filled, so a failed trim only wastes space
+      }
+      ::close(fd);
+    }
+    FileHeader* header() {
+      return reinterpret_cast<FileHeader*>(base);
+    }
+    void resize(int bytes) {
+      size = bytes;
+      header()->size = bytes;
+    }
+    void reserve(size_t bytes) {
+      if (base != nullptr && bytes <= capacity) return;
+      size_t length = (PAGE_BYTES + bytes + extent_size - 1) / extent_size * extent_size;
+      if (::ftruncate(fd, length) == -1) throw sjtu::runtime_error();
+      void *new_base = base == nullptr ?
+          ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) :
+          ::mremap(base, PAGE_BYTES + capacity, length, MREMAP_MAYMOVE);
+      if (new_base == MAP_FAILED) throw sjtu::runtime_error();
+      base = static_cast<char*>(new_base);
+      data = base + PAGE_BYTES;
+      capacity = length - PAGE_BYTES;
+    }
+  };
+  std::shared_ptr<Mapping> mapping;
+ public:
+  MmapStorage(const char *name) : BasicStorage<MmapStorage>(name),
+      mapping(std::make_shared<Mapping>(name, this->initialized_)) {}
+  MmapStorage(const MmapStorage &) = default;
+  MmapStorage(MmapStorage &&) = default;
+  ~MmapStorage() = default;
+  void write(int place, const char *value, size_t bytes) {
+    mapping->reserve(place + bytes);
+    std::memcpy(mapping->data + place, value, bytes);
+    if (place + bytes > static_cast<size_t>(mapping->size)) mapping->resize(place + bytes);
+  }
+  void read(int place, char *value, size_t bytes) {
+    if (place + bytes > mapping->capacity) throw sjtu::index_out_of_bound();
+    std::memcpy(value, mapping->data + place, bytes);
+  }
+  int file_size() {
+    return mapping->size;
+  }
+  int extend(size_t bytes) {
+    int place = mapping->size;
+    mapping->reserve(place + bytes);
+    mapping->resize(place + bytes);
+    return place;
+  }
+  void sync() {
+    if (::msync(mapping->base, PAGE_BYTES + mapping->capacity, MS_SYNC) == -1) throw sjtu::runtime_error();
+  }
+  void prefetch(int place, size_t bytes) {
+    static const long page = ::sysconf(_SC_PAGESIZE);
+    if (place + bytes > mapping->capacity) return;
+    size_t end = PAGE_BYTES + place + bytes, begin = (PAGE_BYTES + place) / page * page;
+    ::madvise(mapping->base + begin, end - begin, MADV_WILLNEED);
+  }
+  template<typename T> requires std::is_trivially_copyable<T>::value
+  const T* view_at(int place) const {
+    if (place + sizeof(T) > mapping->capacity) throw sjtu::index_out_of_bound();
+    return reinterpret_cast<const T*>(mapping->data + place);
+  }
+};
+
+// A fixed number of page_size-aligned frames cached in front of another storage.
+// Pages are evicted with the CLOCK algorithm and dirty ones are written back to
+// the underlying storage on eviction, on flush() and when the last copy dies.
+// A write-back that fails in the last of these is lost silently; sync() first
+// to find out.
+template<typename Inner = FileStorage, int page_size = 4096, int capacity = 256>
+requires (random_access_storage<Inner> && page_size > 0 && capacity > 0)
+class BufferPoolStorage : public BasicStorage<BufferPoolStorage<Inner, page_size, capacity>> {
+ public:
+  struct Statistics {
+    long long hits, misses, evictions, write_backs;
+  };
+ private:
+  struct Frame {
+    int page;
+    bool dirty, referenced;
+  };
+  struct Pool {
+    Inner inner;
+    int size, inner_size, hand;
+    char *pages;
+    Frame frames[capacity];
+    std::unordered_map<int, int> table;
+    Statistics statistics;
+    Pool(const char *name) : inner(name), hand(0), statistics{} {
+      size = inner_size = inner.file_size();
+      pages = static_cast<char*>(std::aligned_alloc(page_size, static_cast<size_t>(page_size) * capacity));
+      if (pages == nullptr) throw sjtu::runtime_error();
+      for (int i = 0; i < capacity; i++) {
+        frames[i] = {-1, false, false};
+      }
+      table.reserve(capacity);
+    }
+    Pool(const Pool &) = delete;
+    Pool& operator = (const Pool &) = delete;
+    ~Pool() {
+      try {
+        flush();
+      } catch (...) {
+        // a destructor has no one to report to: callers that need to know sync() first
+      }
+      std::free(pages);
+    }
+    char *frame_data(int frame) {
+      return pages + static_cast<size_t>(frame) * page_size;
+    }
+    void write_back(int frame) {
+      Frame &f = frames[frame];
+      if (!f.dirty) return;
+      int begin = f.page * page_size;
+      int bytes = std::min(page_size, size - begin);
+      if (bytes > 0) {
+        inner.write(begin, frame_data(frame), bytes);
+        inner_size = std::max(inner_size, begin + bytes);
+      }
+      f.dirty = false;
+      statistics.write_backs++;
+    }
+    int victim() {
+      while (true) {
+        Frame &f = frames[hand];
+        int current = hand;
+        hand = (hand + 1) % capacity;
+        if (f.page == -1) return current;
+        if (f.referenced) {
+          f.referenced = false;
+        } else {
+          write_back(current);
+          table.erase(f.page);
+          f.page = -1;
+          statistics.evictions++;
+          return current;
+        }
+      }
+    }
+    // the frame holding page; whole means the caller overwrites all of it, so
+    // what the inner storage holds there is not read in
+    int fetch(int page, bool whole = false) {
+      auto it = table.find(page);
+      if (it != table.end()) {
+        statistics.hits++;
+        frames[it->second].referenced = true;
+        return it->second;
+      }
+      statistics.misses++;
+      int frame = victim();
+      if (!whole) {
+        char *data = frame_data(frame);
+        int begin = page * page_size;
+        int bytes = std::max(0, std::min(page_size, inner_size - begin));
+        if (bytes > 0) inner.read(begin, data, bytes);
+        std::memset(data + bytes, 0, page_size - bytes);
+      }
+      frames[frame] = {page, false, true};
+      table.emplace(page, frame);
+      return frame;
+    }
+    void flush() {
+      for (int i = 0; i < capacity; i++) {
+        if (frames[i].page != -1) write_back(i);
+      }
+    }
+  };
+  std::shared_ptr<Pool> pool;
+ public:
+  BufferPoolStorage(const char *name) : BasicStorage<BufferPoolStorage>(name), pool(std::make_shared<Pool>(name)) {
+    this->initialized_ = pool->inner.initialized();
+  }
+  BufferPoolStorage(const BufferPoolStorage &) = default;
+  BufferPoolStorage(BufferPoolStorage &&) = default;
+  ~BufferPoolStorage() = default;
+  void write(int place, const char *value, size_t bytes) {
+    pool->size = std::max(pool->size, static_cast<int>(place + bytes));
+    while (bytes > 0) {
+      int page = place / page_size, offset = place % page_size;
+      size_t count = std::min(bytes, static_cast<size_t>(page_size - offset));
+      int frame = pool->fetch(page, count == page_size);
+      std::memcpy(pool->frame_data(frame) + offset, value, count);
+      pool->frames[frame].dirty = true;
+      place += count;
+      value += count;
+      bytes -= count;
+    }
+  }
+  void read(int place, char *value, size_t bytes) {
+    while (bytes > 0) {
+      int page = place / page_size, offset = place % page_size;
+      size_t count = std::min(bytes, static_cast<size_t>(page_size - offset));
+      std::memcpy(value, pool->frame_data(pool->fetch(page)) + offset, count);
+      place += count;
+      value += count;
+      bytes -= count;
+    }
+  }
+  int file_size() {
+    return pool->size;
+  }
+  int extend(size_t bytes) {
+    int place = pool->size;
+    pool->size += bytes;
+    return place;
+  }
+  void flush() {
+    pool->flush();
+  }
+  void sync() {
+    pool->flush();
+    pool->inner.sync();
+  }
+  // passed on to the inner storage unless every page is already in the pool
+  void prefetch(int place, size_t bytes) {
+    int first = place / page_size, last = (place + bytes - 1) / page_size;
+    for (int page = first; page <= last; page++) {
+      if (pool->table.find(page) == pool->table.end()) {
+        pool->inner.prefetch(first * page_size, (last - first + 1) * page_size);
+        return;
+      }
+    }
   }
-  int file_size() override {
-    file->seekp(0, std::ios_base::end);
-    return file->tellp();
+  const Statistics& statistics() const {
+    return pool->statistics;
   }
 };
 
@@ -0,0 +1,166 @@
+#pragma once
+
+#ifndef BPT_LATCH_
+#define BPT_LATCH_
+
+#include <atomic>
+#include <climits>
+#include <functional>
+#include <memory>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+// Reader/writer latches for the blocks of one file, found by the block's place.
+// Blocks come and go with the file, so rather than one latch each they share a
+// fixed set of stripes. Two blocks may therefore map to the same latch, and a
+// thread must hold at most one of them at a time, or it could wait on itself.
+//
+// Each stripe also counts the writes made under its latch, for readers that take
+// no latch: a Writing guard makes the count odd for as long as it lives, and a
+// reader trusts a copy of a block only if the count was even and the same before
+// and after it. Readers only load the count, so they never write shared memory.
+class BlockLatches {
+ private:
+  static const int STRIPE_BITS = 10;
+  // a cache line each, so that threads on different stripes do not contend
+  struct alignas(64) Stripe {
+    std::shared_mutex latch;
+    std::atomic<unsigned> version{0};
+  };
+  std::unique_ptr<Stripe[]> stripes;
+  Stripe& stripe(int place) {
+    // places are multiples of the block size, so only a multiplicative hash spreads them
+    return stripes[static_cast<unsigned>(place) * 2654435761u >> (32 - STRIPE_BITS)];
+  }
+ public:
+  BlockLatches() : stripes(new Stripe[1 << STRIPE_BITS]) {}
+  BlockLatches(const BlockLatches &) = delete;
+  BlockLatches& operator = (const BlockLatches &) = delete;
+  std::shared_mutex& operator[] (int place) {
+    return stripe(place).latch;
+  }
+  // what a reader checks its copy of the block at place against
+  unsigned version(int place) {
+    return stripe(place).version.load(std::memory_order_acquire);
+  }
+  // true if nothing was written to the block at place since version was read;
+  // the copy the reader made in between is then whole
+  bool validate(int place, unsigned version) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return !(version & 1) && stripe(place).version.load(std::memory_order_relaxed) == version;
+  }
+  // brackets a write to the block at place, which the writer has latched exclusively
+  class Writing {
+   private:
+    std::atomic<unsigned> &version;
+   public:
+    Writing(BlockLatches &latches, int place) : version(latches.stripe(place).version) {
+      version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+    Writing(const Writing &) = delete;
+    Writing& operator = (const Writing &) = delete;
+    ~Writing() {
+      version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+  };
+};
+
+// Lets readers that take no latch use memory that writers replace and free. While
+// it may hold a pointer to such memory, a reader announces the epoch it started
+// in, in a slot of its own; a writer frees what it retired only once every reader
+// that started no later is done. Readers store only to their own slot, never to
+// memory other threads write, so they do not contend. A thread claims a slot on
+// its first read and keeps it for life; slots are shared by every instance, and a
+// thread that finds none left is told so, to take a latch instead.
+class ReaderEpochs {
+ private:
+  static const int SLOTS = 256;
+  struct alignas(64) Slot {
+    std::atomic<unsigned long long> entered{0};
+    std::atomic<bool> taken{false};
+  };
+  inline static std::atomic<unsigned long long> epoch{1};
+  static Slot* slots() {
+    static Slot all[SLOTS];
+    return all;
+  }
+  struct Claim {
+    Slot *slot = nullptr;
+    Claim() {
+      for (Slot *candidate = slots(); candidate != slots() + SLOTS; candidate++) {
+        if (!candidate->taken.exchange(true, std::memory_order_acquire)) {
+          slot = candidate;
+          break;
+        }
+      }
+    }
+    ~Claim() {
+      if (slot) slot->taken.store(false, std::memory_order_release);
+    }
+  };
+  static Slot* own() {
+    thread_local Claim claim;
+    return claim.slot;
+  }
+  struct Retired {
+    unsigned long long epoch;
+    std::function<void()> free;
+  };
+  std::vector<Retired> retired;
+ public:
+  ReaderEpochs() = default;
+  ReaderEpochs(const ReaderEpochs &) = delete;
+  ReaderEpochs& operator = (const ReaderEpochs &) = delete;
+  // nobody reads any more once the owner goes
+  ~ReaderEpochs() {
+    for (Retired &entry : retired) entry.free();
+  }
+  // brackets a read; false if the thread has no slot. Readings do not nest.
+  class Reading {
+   private:
+    Slot *slot;
+   public:
+    Reading() : slot(own()) {
+      if (slot) {
+        slot->entered.store(epoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+      }
+    }
+    Reading(const Reading &) = delete;
+    Reading& operator = (const Reading &) = delete;
+    ~Reading() {
+      if (slot) slot->entered.store(0, std::memory_order_release);
+    }
+    explicit operator bool() const {
+      return slot != nullptr;
+    }
+  };
+  // Has free called once no reader can still use what it frees, which readers
+  // starting from now on must not be able to reach. Writers retire one at a time.
+  void retire(std::function<void()> free) {
+    retired.push_back(Retired{epoch.fetch_add(1, std::memory_order_seq_cst), std::move(free)});
+    collect();
+  }
+  void collect() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    unsigned long long oldest = ULLONG_MAX;
+    for (Slot *slot = slots(); slot != slots() + SLOTS; slot++) {
+      unsigned long long entered = slot->entered.load(std::memory_order_acquire);
+      if (entered && entered < oldest) oldest = entered;
+    }
+    // a reader that entered later than the retirement found the replacement
+    size_t kept = 0;
+    for (Retired &entry : retired) {
+      if (entry.epoch < oldest) {
+        entry.free();
+      } else {
+        retired[kept++] = std::move(entry);
+      }
+    }
+    retired.resize(kept);
+  }
+};
+
+#endif
@@ -7,14 +7,39 @@
 #include "vector.hpp"
 #include "utility.hpp"
 #include "exceptions.hpp"
+#include "external_sort.hpp"
+#include "latch.hpp"
 #include <iostream>
 #include <cstddef>
+#include <cstring>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+#include <algorithm>
 
 using sjtu::vector;
 
+// The most entries a block of BlockList<Data, n> can have while it, links and
+// size included, still fits in bytes. A list built with it reads and writes
+// every block as exactly bytes / PAGE_BYTES whole pages.
+template<typename Data>
+constexpr int block_capacity(size_t bytes = PAGE_BYTES) {
+  auto align = [] (size_t x, size_t to) { return (x + to - 1) / to * to; };
+  size_t const data = align(2 * sizeof(int), alignof(Data));
+  size_t const whole = std::max(alignof(Data), alignof(int));
+  int n = (bytes - data) / sizeof(Data);
+  while (n > 0 && align(align(data + n * sizeof(Data), alignof(int)) + sizeof(int), whole) > bytes) n--;
+  return n;
+}
+
+// A sorted chain of blocks of up to block_size entries each, kept in storage.
+// It takes no latches of its own: threads may share one only through a
+// container that latches around it, as BlockBlockList does in concurrent mode,
+// and latch_with() lets view_block() honour that container's leaf latches.
 template<typename Data, int block_size, typename Storage> 
-requires std::is_base_of<BasicStorage, Storage>::value
+requires random_access_storage<Storage>
 class BlockList {
   using RawData = std::decay<decltype(extract_data(Data()))>::type;
   // static_assert(std::is_same_v<RawData, Data>);
@@ -27,6 +52,35 @@ class BlockList {
     int next, prev;
     RawData first;
   };
+  // first key and place of every block in chain order, kept once build_index() ran
+  struct IndexEntry {
+    RawData first;
+    int place;
+  };
+  vector<IndexEntry> index;
+  bool indexed = false;
+  // the latches of a container that lets several threads in, if there is one
+  BlockLatches *latches = nullptr;
+  // last slot whose block may hold x, the first one if x sorts before all of them
+  int find_slot(const RawData &x) const {
+    int l = 0, r = index.size();
+    while (l < r) {
+      int mid = (l + r) / 2;
+      if (x < index[mid].first) {
+        r = mid;
+      } else {
+        l = mid + 1;
+      }
+    }
+    return std::max(l - 1, 0);
+  }
+  int slot_of(int place, const RawData &first) const {
+    int slot = find_slot(first);
+    // blocks may share their first key, so step back to the right one
+    while (slot >= 0 && index[slot].place != place) slot--;
+    if (slot < 0) throw sjtu::runtime_error();
+    return slot;
+  }
   struct Block {
     static const int remaining_num = block_size * 2 / 3;
     int next, prev;
@@ -48,30 +102,70 @@ class BlockList {
         return data[x];
       }
     }
-    void insert(const Data &x) {
-      if (this->size == block_size) throw sjtu::runtime_error();
-      this->data[this->size] = x;
-      this->size++;
-      for (int i = this->size - 2; i >= 0; i--) {
-        if (x < this->data[i]) {
-          std::swap(this->data[i], this->data[i + 1]);
-        } else {
-          return;
-        }
+    // copies count entries from from to to; the ranges may overlap
+    static void move(Data *to, const Data *from, int count) {
+      if constexpr (std::is_trivially_copyable<Data>::value) {
+        std::memmove(static_cast<void*>(to), static_cast<const void*>(from), count * sizeof(Data));
+      } else if (to < from) {
+        for (int i = 0; i < count; i++) to[i] = from[i];
+      } else {
+        for (int i = count - 1; i >= 0; i--) to[i] = from[i];
       }
     }
-    void erase(const RawData &x) {
-      for (int i = 0; i < this->size; i++) {
-        if (x < this->operator[](i)) return;
-        else if (!(this->operator[](i) < x)) {
-          this->size--;
-          for (int j = i; j < this->size; j++) {
-            this->operator[](j) = this->operator[](j + 1);
-          }
-          return;
+    // first i for which before(i) no longer holds; before has to be monotone
+    template<typename Predicate>
+    int partition_point(Predicate before) const {
+      int l = 0, r = size;
+      while (l < r) {
+        int mid = (l + r) / 2;
+        if (before(mid)) {
+          l = mid + 1;
+        } else {
+          r = mid;
         }
       }
-      return;
+      return l;
+    }
+    // first i with !(operator[](i) < x)
+    int lower_bound(const RawData &x) const {
+      return partition_point([&] (int i) { return this->operator[](i) < x; });
+    }
+    // first i with x < operator[](i)
+    int upper_bound(const RawData &x) const {
+      return partition_point([&] (int i) { return !(x < this->operator[](i)); });
+    }
+    // the same two, comparing whole entries
+    int entry_lower_bound(const Data &x) const {
+      return partition_point([&] (int i) { return data[i] < x; });
+    }
+    int entry_upper_bound(const Data &x) const {
+      return partition_point([&] (int i) { return !(x < data[i]); });
+    }
+    void insert(const Data &x) {
+      insert_at(entry_upper_bound(x), x);
+    }
+    void insert_at(int i, const Data &x) {
+      if (this->size == block_size) throw sjtu::runtime_error();
+      move(this->data + i + 1, this->data + i, this->size - i);
+      this->data[i] = x;
+      this->size++;
+    }
+    // Where the entry x of a parent block is, size if it is not there. Children
+    // that start with the same key are kept in chain order rather than by place,
+    // so an entry is looked for among all those under its key.
+    int entry_of(const Data &x) const
+    requires is_sjtu_pair_with_int<Data>::value {
+      int i = lower_bound(x.first);
+      while (i < size && !(x.first < data[i].first) && data[i].second != x.second) i++;
+      return i < size && !(x.first < data[i].first) ? i : size;
+    }
+    // returns whether x was there
+    bool erase(const RawData &x) {
+      int i = lower_bound(x);
+      if (i == this->size || x < this->operator[](i)) return false;
+      this->size--;
+      move(this->data + i, this->data + i + 1, this->size - i);
+      return true;
     }
   };
   static_assert(offsetof(Block, next) == 0, "Unexpected alignment");
@@ -79,31 +173,51 @@ class BlockList {
   // static_assert(offsetof(typename ParentType::Block, prev) == offsetof(typename BaseType::Block, prev), "Unexpected alignment");
   static_assert(offsetof(BlockHead, first) == offsetof(Block, data), "Unexpected alignment");
   static_assert(offsetof(ParentDataType, first) == 0, "Unexpected alignment in sjtu::pair");
+  // Blocks are padded to whole pages and start on a page boundary, so none of them
+  // straddles two pages. Size block_size with block_capacity to leave no padding.
+  static constexpr size_t BLOCK_BYTES = (sizeof(Block) + PAGE_BYTES - 1) / PAGE_BYTES * PAGE_BYTES;
   void new_block(const Block& block) {
-    int place = storage_handler.file_size();
-    storage_handler.write_at(place, block);
+    int place = storage_handler.allocate(BLOCK_BYTES, PAGE_BYTES);
+    if (indexed) index.push_back(IndexEntry{block[0], place});
     if (block.next != 0) {
-      storage_handler.write_at(block.next + offsetof(Block, prev), place);
+      storage_handler.write_batch({WriteRequest(place, block),
+                                   WriteRequest(block.next + offsetof(Block, prev), place),
+                                   WriteRequest(block.prev, place)});
+    } else {
+      storage_handler.write_batch({WriteRequest(place, block), WriteRequest(block.prev, place)});
     }
-    storage_handler.write_at(block.prev, place);
   }
   void erase_block(const int prev, const int next) {
     if (next != 0) {
-      storage_handler.write_at(next + offsetof(Block, prev), prev);
+      storage_handler.write_batch({WriteRequest(next + offsetof(Block, prev), prev), WriteRequest(prev, next)});
+    } else {
+      storage_handler.write_at(prev, next);
     }
-    storage_handler.write_at(prev, next);
   }
 public:
   struct AutonomousBlock {
-    Storage storage_handler;
+    // the storage of the list, which outlives the block; nothing is copied per block
+    Storage &storage_handler;
     int const place;
     bool changed;
     Block block;
-    AccumulativeFunc<typename ParentType::AutonomousBlock&> back;
+    // left for the parent to apply once this block is written back; a block
+    // changed several times folds the fix-ups together
+    ParentFixUp<RawData> back;
+    // the list whose index follows this block, if it keeps one
+    BlockList *const owner;
+    int slot;
     AutonomousBlock(Storage &other, int place_) : storage_handler(other), place(place_), changed(false), 
-        back([] (typename ParentType::AutonomousBlock&) {}) {
+        owner(nullptr), slot(-1) {
+      if (place == 0) throw sjtu::runtime_error();
+      storage_handler.read_at(place, block);
+    }
+    // a block in list's own chain; changes to its first key or to the chain reach list's index
+    AutonomousBlock(BlockList &list, int place_) : storage_handler(list.storage_handler), place(place_),
+        changed(false), owner(list.indexed ? std::addressof(list) : nullptr), slot(-1) {
       if (place == 0) throw sjtu::runtime_error();
       storage_handler.read_at(place, block);
+      if (owner) slot = owner->slot_of(place, block[0]);
     }
     AutonomousBlock(const AutonomousBlock &) = delete;
     AutonomousBlock(AutonomousBlock &&) = delete;
@@ -112,18 +226,36 @@ public:
     ~AutonomousBlock() {
       if (changed) storage_handler.write_at(place, block);
     }
+    void index_first() {
+      if (owner) owner->index[slot].first = block[0];
+    }
+    // marks the block dirty and has the index and the parent follow its first key
+    void settle_first(const RawData &old_first) {
+      changed = true;
+      if (old_first < block[0] || block[0] < old_first) {
+        index_first();
+        back += ParentFixUp<RawData>::replacing(old_first, block[0], place);
+      }
+    }
+    // The next block's first key, which bounds what belongs in this one; false
+    // for the last block.
+    bool next_first(RawData &x) {
+      if (!block.next) return false;
+      if (owner) {
+        x = owner->index[slot + 1].first;
+      } else {
+        storage_handler.read_at(block.next + offsetof(BlockHead, first), x);
+      }
+      return true;
+    }
+    // place of the child whose range holds x
+    int child(const RawData &x) const
+    requires is_sjtu_pair_with_int<Data>::value {
+      return block.data[std::max(block.upper_bound(x) - 1, 0)].second;
+    }
     int find(const RawData &first) {
       if constexpr (is_sjtu_pair_with_int<Data>::value) {
-        int next_place = -1;
-        for (int i = 0; i < block.size; i++) {
-          if (first < block.operator[](i)) {
-            next_place = block.data[std::max(i - 1, 0)].second;
-            break;
-          }
-        }
-        if (next_place == -1) {
-          next_place = block.data[block.size - 1].second;
-        }
+        int next_place = child(first);
         int prev;
         storage_handler.read_at(next_place + offsetof(Block, prev), prev);
         if (prev) {
@@ -138,171 +270,218 @@ public:
     }
     void insert(const RawData &x)
     requires is_sjtu_pair_with_int<Data>::value {
-      int next_place = -1;
-      for (int i = 0; i < block.size; i++) {
-        if (x < block[i]) {
-          next_place = block.data[std::max(i - 1, 0)].second;
-          break;
-        }
-      }
-      if (next_place == -1) {
-        // std::cerr << "correct not found\n";
-        next_place = block.data[block.size - 1].second;
-      }
+      int next_place = child(x);
       int prev;
       storage_handler.read_at(next_place + offsetof(Block, prev), prev);
       // std::cerr << offsetof(Block, prev) << " should be sizeof(int): " << sizeof(int) << "\n";
-      AccumulativeFunc<typename ParentType::AutonomousBlock&> ret;
+      ParentFixUp<RawData> fix_up;
       if (prev == 0) {
         // std::cerr << "Parent::AutoBlock::insert::INCORRECT finding ParentType\n";
         typename ParentType::AutonomousBlock child(storage_handler, next_place);
         child.insert(x);
-        ret = std::move(child.back);
+        fix_up = child.back;
       } else {
         // std::cerr << "Parent::AutoBlock::insert::correct finding BaseType\n";
         typename BaseType::AutonomousBlock child(storage_handler, next_place);
         child.insert(x);
-        ret = std::move(child.back);
+        fix_up = child.back;
       }
-      ret(*this);
+      fix_up.apply(*this);
       // std::cerr << "Parent::AutoBlock::insert::END\n";
     }
     void erase(const RawData &x)
     requires is_sjtu_pair_with_int<Data>::value {
-      int next_place = block.size - 1;
-      for (int i = 0; i < block.size; i++) {
-        if (x < block[i]) {
-          next_place = std::max(i - 1, 0);
-          break;
-        }
-      }
-      next_place = block.data[next_place].second;
+      int next_place = child(x);
       int prev;
       storage_handler.read_at(next_place + offsetof(Block, prev), prev);
-      AccumulativeFunc<typename ParentType::AutonomousBlock&> ret;
+      ParentFixUp<RawData> fix_up;
       if (prev == 0) {
         typename ParentType::AutonomousBlock child(storage_handler, next_place);
         child.erase(x);
-        ret = std::move(child.back);
+        fix_up = child.back;
       } else {
         typename BaseType::AutonomousBlock child(storage_handler, next_place);
         child.erase(x);
-        ret = std::move(child.back);
+        fix_up = child.back;
       }
-      ret(*this);
+      fix_up.apply(*this);
     }
-    void replace(const RawData &x, const RawData &y)
+    // files the entry for the child at child_place under y instead of x
+    void replace(const RawData &x, const RawData &y, int child_place)
     requires is_sjtu_pair_with_int<Data>::value {
       changed = true;
       // std::cerr << x.str << " :x, " << y.str << " :y, replacing...\n";
-      for (int i = 0; i < block.size; i++) {
-        if (!(block[i] < x)) {
-          if (x < block[i]) {
-            // std::cerr << x.str << " :x, " << block[i].str << " :block[i], " << i << ":i, throwing...\n";
-            throw sjtu::runtime_error();
-          }
-          block[i] = y;
-          if (i == 0) {
-            back = [new_x = x, new_y = y] (typename ParentType::AutonomousBlock &block) {
-                block.replace(new_x, new_y); 
-            };
-          }
-          return;
-        }
+      int i = block.entry_of(Data(x, child_place));
+      if (i == block.size) {
+        // std::cerr << x.str << " :x, " << block[i].str << " :block[i], " << i << ":i, throwing...\n";
+        throw sjtu::runtime_error();
+      }
+      block[i] = y;
+      if (i == 0) {
+        index_first();
+        back += ParentFixUp<RawData>::replacing(x, y, place);
       }
-      throw sjtu::runtime_error();
     }
-    void erase(const Data &x, bool const enable_merge = false) {
+    void erase(const Data &x) {
       // if constexpr (is_sjtu_pair_with_int<Data>::value) std::cerr << "erasing parent" << x.first.str << "\n";
-      for (int i = 0; i < block.size; i++) {
-        if (x < block.data[i]) return;
-        else if (!(block.data[i] < x)) {
-          // if constexpr (is_sjtu_pair_with_int<Data>::value) std::cerr << "correctly erasing parent\n";
-          changed = true;
-          block.size--;
-          for (int j = i; j < block.size; j++) {
-            block.data[j] = block.data[j + 1];
-          }
-          if (block.size == 0) {
-            if (block.prev) {
-              // std::cerr << "clearing block with prev=" << block.prev << '\n';
-              storage_handler.write_at(block.prev, block.next);
-              if (block.next) {
-                storage_handler.write_at(block.next + offsetof(Block, prev), block.prev);
-              }
-            }
-            back = [this_first = block[0], this_place = place]
-                (typename ParentType::AutonomousBlock &auto_block) {
-              auto_block.erase(ParentDataType(this_first, this_place));
-            };
-            changed = false;
-            return;
-          }
-          if (enable_merge && block.next) {
-            int next_size;
-            storage_handler.read_at(block.next + offsetof(Block, size), next_size);
-            if (block.size + next_size < block_size / 2) {
-              Block next;
-              storage_handler.read_at(block.next, next);
-              for (int i = 0; i < next.size; i++) {
-                block.data[i + block.size] = next.data[i];
-              }
-              block.size += next.size;
-              block.next = next.next;
-              if (block.next) {
-                storage_handler.write_at(block.next + offsetof(Block, prev), place);
-              }
-              return;
-            }
-          }
-          if (i == 0) {
-            back = [this_first = extract_data(x), new_first = block[0]]
-                (typename ParentType::AutonomousBlock &auto_block) {
-              auto_block.replace(this_first, new_first);
-            };
+      int i;
+      if constexpr (is_sjtu_pair_with_int<Data>::value) {
+        i = block.entry_of(x);
+        if (i == block.size) return;
+      } else {
+        i = block.entry_lower_bound(x);
+        if (i == block.size || x < block.data[i]) return;
+      }
+      // if constexpr (is_sjtu_pair_with_int<Data>::value) std::cerr << "correctly erasing parent\n";
+      changed = true;
+      block.size--;
+      Block::move(block.data + i, block.data + i + 1, block.size - i);
+      if (block.size == 0) {
+        if (block.prev) {
+          // std::cerr << "clearing block with prev=" << block.prev << '\n';
+          if (block.next) {
+            storage_handler.write_batch({WriteRequest(block.prev, block.next),
+                                         WriteRequest(block.next + offsetof(Block, prev), block.prev)});
+          } else {
+            storage_handler.write_at(block.prev, block.next);
           }
-          return;
         }
+        storage_handler.release(place, BLOCK_BYTES);
+        if (owner) owner->index.erase(slot);
+        back += ParentFixUp<RawData>::erasing(block[0], place);
+        changed = false;
+        return;
       }
+      if (i == 0) settle_first(extract_data(x));
     }
-    void insert(const Data &x) {
+    // Puts x in its place, or in a parent block right after the entry for the
+    // child at after, the block it split from.
+    void insert(const Data &x, int after = 0) {
       if (block.size == 0) throw sjtu::runtime_error();
       changed = true;
       Data first = block.data[0];
+      int i = block.entry_upper_bound(x);
+      if constexpr (is_sjtu_pair_with_int<Data>::value) {
+        int j = 0;
+        while (after && j < block.size && block.data[j].second != after) j++;
+        if (after && j < block.size) i = j + 1;
+      }
       if (block.size == block_size) {
         block.size = block.remaining_num;
-        Block block_after(block.next, place, block_size - block.remaining_num);
-        for (int i = block.remaining_num; i < block_size; i++) {
-          block_after.data[i - block.remaining_num] = block.data[i];
-        }
-        if (x < block_after.data[0]) {
-          block.insert(x);
+        // internal nodes below the top level (prev == 0) stay out of any chain
+        bool const chained = block.prev != 0;
+        Block block_after(block.next, chained ? place : 0, block_size - block.remaining_num);
+        Block::move(block_after.data, block.data + block.remaining_num, block_size - block.remaining_num);
+        if (i <= block.remaining_num) {
+          block.insert_at(i, x);
         } else {
-          block_after.insert(x);
+          block_after.insert_at(i - block.remaining_num, x);
         }
-        int new_place = storage_handler.file_size();
-        storage_handler.write_at(new_place, block_after);
+        int new_place = storage_handler.allocate(BLOCK_BYTES, PAGE_BYTES);
+        if (chained) block.next = new_place;
+        // the new block, the old neighbour's prev and this block go out together
         if (block_after.next != 0) {
-          storage_handler.write_at(block_after.next + offsetof(Block, prev), new_place);
+          storage_handler.write_batch({WriteRequest(new_place, block_after),
+                                       WriteRequest(block_after.next + offsetof(Block, prev), new_place),
+                                       WriteRequest(place, block)});
+        } else {
+          storage_handler.write_batch({WriteRequest(new_place, block_after), WriteRequest(place, block)});
         }
-        block.next = new_place;
-        back = [this_first = extract_data(first), 
-                new_first = block[0], 
-                new_block_first = extract_data(block_after[0]), 
-                new_place] (typename ParentType::AutonomousBlock &auto_block) {
-          auto_block.replace(this_first, new_first);
-          auto_block.insert(ParentDataType(new_block_first, new_place));
-        };
+        changed = false;
+        if (owner) {
+          index_first();
+          owner->index.insert(slot + 1, IndexEntry{block_after[0], new_place});
+        }
+        back += ParentFixUp<RawData>::splitting(extract_data(first), block[0], place, block_after[0], new_place);
       } else {
-        block.insert(x);
-        back = [this_first = extract_data(first), new_first = block[0]]
-            (typename ParentType::AutonomousBlock &auto_block) {
-          auto_block.replace(this_first, new_first);
-        };
+        block.insert_at(i, x);
+        settle_first(extract_data(first));
+      }
+    }
+    // The sorted entries of [first, last) that come before limit, or all of
+    // them without one, go into this block while it has room; returns how many
+    // it took. The first one always goes in, splitting a full block.
+    int insert_run(const RawData *first, const RawData *last, const RawData *limit)
+    requires (!is_sjtu_pair_with_int<Data>::value) {
+      if (block.size == block_size) {
+        insert(*first);
+        return 1;
+      }
+      RawData old_first = block[0];
+      int taken = 0;
+      while (first + taken != last && block.size < block_size && (!limit || first[taken] < *limit)) {
+        block.insert(first[taken++]);
       }
+      settle_first(old_first);
+      return taken;
+    }
+    // The same for erasing, short of emptying the block, which is left to erase().
+    // An entry missing from the block is in no block at all if it comes first, as
+    // this is the last block that may hold it. Later in the run it may be a copy of
+    // one just erased, with more copies in the blocks before, so the run ends there
+    // and the entry is looked up again.
+    int erase_run(const RawData *first, const RawData *last, const RawData *limit)
+    requires (!is_sjtu_pair_with_int<Data>::value) {
+      if (block.size == 1) {
+        erase(*first);
+        return 1;
+      }
+      RawData old_first = block[0];
+      int size = block.size, taken = 0;
+      while (first + taken != last && block.size > 1 && (!limit || first[taken] < *limit)) {
+        if (!block.erase(first[taken]) && taken > 0) break;
+        taken++;
+      }
+      if (block.size != size) settle_first(old_first);
+      return taken;
+    }
+    // Hands the entries under this block to its children a run per child. Stops
+    // once this block splits or empties, as the rest then has to be routed again.
+    template<bool inserting>
+    int route_run(const RawData *first, const RawData *last, const RawData *limit)
+    requires is_sjtu_pair_with_int<Data>::value {
+      int taken = 0;
+      auto run = [&] (auto &child, const RawData *child_limit) {
+        if constexpr (inserting) {
+          taken += child.insert_run(first + taken, last, child_limit);
+        } else {
+          taken += child.erase_run(first + taken, last, child_limit);
+        }
+        return child.back;
+      };
+      while (first + taken != last && (!limit || first[taken] < *limit)) {
+        // what now sorts before this block may lie in the blocks before it
+        if (taken > 0 && first[taken] < block[0]) break;
+        int j = std::max(block.upper_bound(first[taken]) - 1, 0);
+        int next_place = block.data[j].second;
+        // the child's range ends where the next child's starts, or where this block's does
+        const RawData *child_limit = j + 1 < block.size ? &block[j + 1] : limit;
+        int prev;
+        storage_handler.read_at(next_place + offsetof(Block, prev), prev);
+        ParentFixUp<RawData> fix_up;
+        if (prev == 0) {
+          typename ParentType::AutonomousBlock child(storage_handler, next_place);
+          fix_up = run(child, child_limit);
+        } else {
+          typename BaseType::AutonomousBlock child(storage_handler, next_place);
+          fix_up = run(child, child_limit);
+        }
+        fix_up.apply(*this);
+        if (block.size == 0 || (back.kind & ~ParentFixUp<RawData>::REPLACE)) break;
+      }
+      return taken;
+    }
+    int insert_run(const RawData *first, const RawData *last, const RawData *limit)
+    requires is_sjtu_pair_with_int<Data>::value {
+      return route_run<true>(first, last, limit);
+    }
+    int erase_run(const RawData *first, const RawData *last, const RawData *limit)
+    requires is_sjtu_pair_with_int<Data>::value {
+      return route_run<false>(first, last, limit);
     }
   };
-  static const int ROOT_SIZE = sizeof(root);
+  // the first block and the head of the chain of released blocks
+  static const int ROOT_SIZE = 2 * sizeof(root);
   // template<typename... Args>
   // BlockList (Args... args) : BlockList(0, args...) {}
   template<typename... Args>
@@ -313,28 +492,280 @@ public:
       // std::cerr << storage_handler.file_size() << "\nINCORRECT constructing...\n";
     } else {
       // std::cerr << "constructing...\n";
-      storage_handler.template write_at<decltype(root)>(root, 0);
+      int const header[2] = {0, 0};
+      storage_handler.write_at(root, header);
     }
+    storage_handler.track_free_blocks(BLOCK_BYTES, root + sizeof(root));
   }
   int operator&() const {
     return root;
   }
-  vector<RawData> find(const RawData &begin, const RawData &end, int current_block)
-  requires (!is_sjtu_pair_with_int<Data>::value) {
-    vector<RawData> ret{};
+  // Lays data handed over in ascending order out as a chain of blocks, each filled
+  // with up to fill entries, in the order they are allocated. The list has to be
+  // empty; nothing is visible through it before finish() or destruction, and the
+  // appender must not be used after finish().
+  class Appender {
+   private:
+    BlockList &list;
+    int const fill;
+    int place;
     Block block;
+   public:
+    Appender(BlockList &list_, int fill_ = block_size) :
+        list(list_), fill(std::max(1, std::min(fill_, block_size))), place(0) {
+      int first;
+      list.storage_handler.read_at(list.root, first);
+      if (first) throw sjtu::runtime_error();
+    }
+    Appender(const Appender &) = delete;
+    Appender& operator = (const Appender &) = delete;
+    ~Appender() {
+      finish();
+    }
+    // returns where x went if it started a new block, 0 otherwise
+    int push(const Data &x) {
+      if (place != 0 && x < block.data[block.size - 1]) throw sjtu::runtime_error();
+      if (place != 0 && block.size < fill) {
+        block.data[block.size++] = x;
+        return 0;
+      }
+      int new_place = list.storage_handler.allocate(BLOCK_BYTES, PAGE_BYTES);
+      if (place == 0) {
+        list.storage_handler.write_at(list.root, new_place);
+        block = Block(0, list.root, 0);
+      } else {
+        block.next = new_place;
+        list.storage_handler.write_at(place, block);
+        block = Block(0, place, 0);
+      }
+      place = new_place;
+      block.data[block.size++] = x;
+      if (list.indexed) list.index.push_back(IndexEntry{block[0], place});
+      return place;
+    }
+    void finish() {
+      if (place) list.storage_handler.write_at(place, block);
+      place = 0;
+    }
+  };
+  // Writes the live data to a new list at the same root in the file at target,
+  // fill entries per block and the blocks one after another in key order, so none
+  // of the blocks released here is carried over. Swap the files while neither is open.
+  void compact(const char *target, int fill = block_size)
+  requires (!is_sjtu_pair_with_int<Data>::value) {
+    BlockList result(root, target);
+    Appender out(result, fill);
+    for_each([&] (const Data &x) { out.push(x); });
+  }
+  // Fills the empty list from [first, last), which has to be in ascending order,
+  // with fill entries per block and the blocks written one after another.
+  template<typename Iterator>
+  void bulk_load(Iterator first, Iterator last, int fill = block_size) {
+    Appender out(*this, fill);
+    for (; first != last; ++first) out.push(*first);
+  }
+  // the same for input in any order, sorted in runs of at most run_bytes
+  template<typename Iterator>
+  void bulk_load_unsorted(Iterator first, Iterator last, int fill = block_size, size_t run_bytes = 1 << 26) {
+    Appender out(*this, fill);
+    external_sort<Data>(first, last, [&] (const Data &x) { out.push(x); }, run_bytes);
+  }
+  template<typename Function>
+  void for_each(Function function) {
+    Block buffer;
+    int current_block;
+    storage_handler.read_at(root, current_block);
     while (current_block) {
-      storage_handler.read_at(current_block, block);
+      const Block &block = view_block(current_block, buffer);
       for (int i = 0; i < block.size; i++) {
-        if (block[i] < begin) continue;
-        if (end < block[i]) return ret;
-        ret.push_back(block[i]);
+        function(block.data[i]);
       }
       current_block = block.next;
     }
+  }
+  // the blocks as stored, for containers that copy them on their own
+  using BlockType = Block;
+  // Reads the block at place into buffer, unless the storage can point straight at
+  // it. Under latches the block is always copied, while its latch is held.
+  const Block& view_block(int place, Block &buffer) {
+    if (latches) {
+      std::shared_lock latch((*latches)[place]);
+      storage_handler.read_at(place, buffer);
+      return buffer;
+    }
+    if constexpr (requires { storage_handler.template view_at<Block>(place); }) {
+      return *storage_handler.template view_at<Block>(place);
+    } else {
+      storage_handler.read_at(place, buffer);
+      return buffer;
+    }
+  }
+  // Walks the entries from begin through end in order a block at a time, straight
+  // from storage, holding one block instead of collecting every match. The list
+  // must not change while a cursor is in use.
+  class Cursor {
+   private:
+    // storages that take requests in the background read the next block straight
+    // into a second buffer; the others are only asked to prefetch it
+    static constexpr bool ASYNC = requires (Storage storage, char *buffer) {
+      storage.submit_read(0, buffer, sizeof(Block), [] (int) {});
+      storage.complete();
+    };
+    struct Empty {};
+    BlockList &list;
+    RawData const end;
+    Block buffer;
+    [[no_unique_address]] std::conditional_t<ASYNC, Block, Empty> spare;
+    const Block *block;
+    int i;
+    // place of the block being read ahead into whichever of buffer and spare the
+    // cursor is not reading from, 0 if none
+    int ahead = 0;
+    bool reading = false;
+    void wait() {
+      if constexpr (ASYNC) {
+        while (reading) list.storage_handler.complete();
+      }
+    }
+    // moves on to the first entry at or after i, into later blocks if need be
+    void settle() {
+      while (i == block->size) {
+        if (!block->next) {
+          block = nullptr;
+          return;
+        }
+        if constexpr (ASYNC) {
+          Block *other = block == &buffer ? &spare : &buffer;
+          wait();
+          if (ahead != block->next) list.storage_handler.read_at(block->next, *other);
+          block = other;
+          ahead = 0;
+          // past its first block the scan is a long one: the block after this
+          // one is read into the one just left while this one is consumed
+          if (block->next) {
+            other = block == &buffer ? &spare : &buffer;
+            ahead = block->next;
+            reading = true;
+            list.storage_handler.submit_read(ahead, reinterpret_cast<char*>(other), sizeof(Block),
+                                             [this] (int result) {
+              reading = false;
+              if (result != sizeof(Block)) ahead = 0;
+            });
+            list.storage_handler.submit();
+          }
+        } else {
+          block = &list.view_block(block->next, buffer);
+          // past its first block the scan is a long one: have the storage fetch the
+          // block after this one while this one is consumed
+          if (block->next) list.storage_handler.prefetch(block->next, sizeof(Block));
+        }
+        i = 0;
+      }
+      if (end < (*block)[i]) block = nullptr;
+    }
+   public:
+    // starts in the block at place, 0 for an empty list
+    Cursor(BlockList &list_, const RawData &begin, const RawData &end_, int place) :
+        list(list_), end(end_), block(nullptr), i(0) {
+      if (place == 0) return;
+      block = &list.view_block(place, buffer);
+      // only the block the scan starts in can hold entries before begin
+      i = block->lower_bound(begin);
+      settle();
+    }
+    Cursor(const Cursor &) = delete;
+    Cursor& operator = (const Cursor &) = delete;
+    ~Cursor() {
+      wait();
+    }
+    explicit operator bool() const {
+      return block != nullptr;
+    }
+    const RawData& operator*() const {
+      return (*block)[i];
+    }
+    const RawData* operator->() const {
+      return &(*block)[i];
+    }
+    Cursor& operator++() {
+      i++;
+      settle();
+      return *this;
+    }
+  };
+  Cursor scan(const RawData &begin, const RawData &end, int current_block)
+  requires (!is_sjtu_pair_with_int<Data>::value) {
+    return Cursor(*this, begin, end, current_block);
+  }
+  vector<RawData> find(const RawData &begin, const RawData &end, int current_block)
+  requires (!is_sjtu_pair_with_int<Data>::value) {
+    vector<RawData> ret{};
+    for (Cursor cursor(*this, begin, end, current_block); cursor; ++cursor) {
+      ret.push_back(*cursor);
+    }
     return ret;
   }
+  // Has cursors read each block under its latch in latches. Whoever sets them is in
+  // charge of latching the blocks it changes.
+  void latch_with(BlockLatches *latches_) {
+    latches = latches_;
+  }
+  // Reads the first key of every block once so that find_block no longer walks the
+  // chain. From then on the chain may only change through this object: blocks
+  // reached some other way, e.g. as children of a parent list, are not tracked.
+  void build_index() {
+    index.clear();
+    BlockHead head;
+    int current_block;
+    storage_handler.read_at(root, current_block);
+    while (current_block) {
+      storage_handler.read_at(current_block, head);
+      index.push_back(IndexEntry{head.first, current_block});
+      current_block = head.next;
+    }
+    indexed = true;
+  }
+  // calls function(first, place) for every block of the chain, from the index
+  template<typename Function>
+  void for_each_indexed(Function function) const {
+    for (size_t i = 0; i < index.size(); i++) function(index[i].first, index[i].place);
+  }
+  int chain_length() {
+    if (indexed) return index.size();
+    int length = 0, current_block;
+    storage_handler.read_at(root, current_block);
+    while (current_block) {
+      length++;
+      storage_handler.read_at(current_block, current_block);
+    }
+    return length;
+  }
+  // Detaches every block of the chain, which leaves them internal nodes (prev == 0)
+  // that parents route through, and files them in a new chain one level up.
+  void raise()
+  requires is_sjtu_pair_with_int<Data>::value {
+    vector<IndexEntry> children;
+    BlockHead head;
+    int current_block;
+    storage_handler.read_at(root, current_block);
+    while (current_block) {
+      storage_handler.read_at(current_block, head);
+      children.push_back(IndexEntry{head.first, current_block});
+      current_block = head.next;
+    }
+    int const detached[2] = {0, 0};
+    for (size_t i = 0; i < children.size(); i++) {
+      storage_handler.write_at(children[i].place, detached);
+    }
+    storage_handler.template write_at<int>(root, 0);
+    index.clear();
+    Appender out(*this);
+    for (size_t i = 0; i < children.size(); i++) {
+      out.push(Data(children[i].first, children[i].place));
+    }
+  }
   int find_block(const RawData &x) {
+    if (indexed) return index.empty() ? 0 : index[find_slot(x)].place;
     // if constexpr (is_sjtu_pair_with_int<Data>::value) std::cerr << "heads.find_block(x)\n";
     BlockHead head;
     int current_block;
@@ -349,23 +780,44 @@ public:
     }
     return current_block;
   }
+  // Hands the sorted entries of [first, last) to run(block, first, last, limit)
+  // one block at a time, limit being where the next block starts, so each block
+  // is read and written once per run; run returns how many entries it took.
+  // Returns where it stopped, which is short of last only if the list is empty.
+  template<typename Run>
+  const RawData* apply_runs(const RawData *first, const RawData *last, Run run) {
+    while (first != last) {
+      int place = find_block(*first);
+      if (place == 0) break;
+      AutonomousBlock block(*this, place);
+      RawData next;
+      first += run(block, first, last, block.next_first(next) ? &next : nullptr);
+    }
+    return first;
+  }
+  Cursor scan(const RawData &begin, const RawData &end)
+  requires (!is_sjtu_pair_with_int<Data>::value) {
+    return Cursor(*this, begin, end, find_block(begin));
+  }
   vector<RawData> find(const RawData &begin, const RawData &end)
   requires (!is_sjtu_pair_with_int<Data>::value) {
     return find(begin, end, find_block(begin));
   }
   void insert(const Data &x)
   requires (!is_sjtu_pair_with_int<Data>::value) {
+    OperationGuard guard(storage_handler);
     int t = find_block(extract_data(x));
     if (t == 0) {
       Block block(0, root, 1);
       block.data[0] = x;
       new_block(block);
     } else {
-      AutonomousBlock(storage_handler, find_block(extract_data(x))).insert(x);
+      AutonomousBlock(*this, t).insert(x);
     }
   }
   void insert(const Data &x)
   requires (is_sjtu_pair_with_int<Data>::value) {
+    OperationGuard guard(storage_handler);
     int t = find_block(extract_data(x));
     if (t == 0) {
       Block block(0, root, 1);
@@ -377,7 +829,35 @@ public:
   }
   void erase(const Data &x)
   requires (!is_sjtu_pair_with_int<Data>::value) {
-    AutonomousBlock(storage_handler, find_block(extract_data(x))).erase(x);
+    OperationGuard guard(storage_handler);
+    int t = find_block(extract_data(x));
+    if (t == 0) return;
+    AutonomousBlock(*this, t).erase(x);
+  }
+  template<typename Iterator>
+  void insert_batch(Iterator first, Iterator last)
+  requires (!is_sjtu_pair_with_int<Data>::value) {
+    std::vector<Data> batch(first, last);
+    std::sort(batch.begin(), batch.end());
+    OperationGuard guard(storage_handler);
+    const Data *begin = batch.data(), *end = begin + batch.size();
+    while ((begin = apply_runs(begin, end, [] (AutonomousBlock &block, const Data *first, const Data *last,
+                                                const Data *limit) {
+      return block.insert_run(first, last, limit);
+    })) != end) {
+      insert(*begin++);
+    }
+  }
+  template<typename Iterator>
+  void erase_batch(Iterator first, Iterator last)
+  requires (!is_sjtu_pair_with_int<Data>::value) {
+    std::vector<Data> batch(first, last);
+    std::sort(batch.begin(), batch.end());
+    OperationGuard guard(storage_handler);
+    apply_runs(batch.data(), batch.data() + batch.size(), [] (AutonomousBlock &block, const Data *first,
+                                                              const Data *last, const Data *limit) {
+      return block.erase_run(first, last, limit);
+    });
   }
 };
 
@@ -15,7 +15,7 @@ struct KeyAndValue {
   }
   bool operator == (const KeyAndValue &other) const = delete;
 } ind;
-BlockBlockList<KeyAndValue, 3 * 4096 / (sizeof(KeyAndValue) + sizeof(int)), FileStorage> tree("list");
+BlockBlockList<KeyAndValue, block_capacity<sjtu::pair<KeyAndValue, int>>(3 * PAGE_BYTES), FileStorage> tree("list");
 int main() {
   std::ios::sync_with_stdio(false);
   cin.tie(nullptr);
@@ -26,12 +26,12 @@ int main() {
     cin >> option;
     if (option[0] == 'f') { // "find"
       cin >> ind.str;
-      auto result = tree.find(KeyAndValue(ind.str, INT_MIN), KeyAndValue(ind.str, INT_MAX));
-      if (result.size() == 0) {
+      auto result = tree.scan(KeyAndValue(ind.str, INT_MIN), KeyAndValue(ind.str, INT_MAX));
+      if (!result) {
         cout << "null\n";
       } else {
-        for (const auto &tmp : result) {
-          cout << tmp.value << ' ';
+        for (; result; ++result) {
+          cout << result->value << ' ';
         }
         cout << '\n';
       }
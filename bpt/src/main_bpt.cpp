@@ -26,12 +26,12 @@ int main() {
     cin >> option;
     if (option[0] == 'f') { // "find"
       cin >> ind.str;
-      auto result = tree.find(KeyAndValue(ind.str, INT_MIN), KeyAndValue(ind.str, INT_MAX));
-      if (result.size() == 0) {
+      auto result = tree.scan(KeyAndValue(ind.str, INT_MIN), KeyAndValue(ind.str, INT_MAX));
+      if (!result) {
         cout << "null\n";
       } else {
-        for (const auto &tmp : result) {
-          cout << tmp.value << ' ';
+        for (; result; ++result) {
+          cout << result->value << ' ';
         }
         cout << '\n';
       }
@@ -1,4 +1,4 @@
-#include "tree.hpp"
+#include "list.hpp"
 #include <algorithm>
 #include <iostream>
 #include <cstring>
@@ -16,10 +16,11 @@ struct KeyAndValue {
     return i ? i < 0 : value < other.value;
   }
 } ind;
-BlockList<KeyAndValue, 221, FileStorage> list("list");
+BlockList<KeyAndValue, block_capacity<KeyAndValue>(4 * PAGE_BYTES), FileStorage> list(sizeof(int), "list");
 int main() {
   std::ios::sync_with_stdio(false);
   cin.tie(nullptr);
+  list.build_index();
   int n;
   char option[10];
   cin >> n;
@@ -27,12 +28,12 @@ int main() {
     cin >> option;
     if (option[0] == 'f') { // "find"
       cin >> ind.str;
-      auto result = list.find(KeyAndValue(ind.str, 0), KeyAndValue(ind.str, INT_MAX));
-      if (result.size() == 0) {
+      auto result = list.scan(KeyAndValue(ind.str, 0), KeyAndValue(ind.str, INT_MAX));
+      if (!result) {
         cout << "null\n";
       } else {
-        for (const auto &tmp : result) {
-          cout << tmp.value << ' ';
+        for (; result; ++result) {
+          cout << result->value << ' ';
         }
         cout << '\n';
       }
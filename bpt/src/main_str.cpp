@@ -0,0 +1,31 @@
+#include "string_list.hpp"
+#include <iostream>
+using std::cin, std::cout, std::endl;
+char key[66];
+StringBlockList<4096, FileStorage> list("list");
+int main() {
+  std::ios::sync_with_stdio(false);
+  cin.tie(nullptr);
+  int n, value;
+  char option[10];
+  cin >> n;
+  for (int i = 0; i < n; i++) {
+    cin >> option;
+    if (option[0] == 'f') { // "find"
+      cin >> key;
+      bool found = false;
+      list.for_each(key, [&] (int value) {
+        cout << value << ' ';
+        found = true;
+      });
+      cout << (found ? "\n" : "null\n");
+    } else if (option[0] == 'd') { // "delete"
+      cin >> key >> value;
+      list.erase(key, value);
+    } else { // "insert"
+      cin >> key >> value;
+      list.insert(key, value);
+    }
+  }
+  return 0;
+}
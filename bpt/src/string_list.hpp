@@ -0,0 +1,385 @@
+#pragma once
+
+#ifndef BPT_STRING_LIST_
+#define BPT_STRING_LIST_
+
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <climits>
+#include <vector>
+#include <algorithm>
+#include "file.hpp"
+#include "vector.hpp"
+#include "exceptions.hpp"
+
+// A sorted list of (string key, int value) entries kept in a chain of pages of
+// page_bytes each. Keys are front coded: an entry stores only the bytes it does
+// not share with the entry before it, except at the start of every restart group
+// of at most RESTART_INTERVAL entries, which stores its whole key. The offsets of
+// those restart entries form a slot directory at the end of the page, so a lookup
+// binary searches them and then decodes at most RESTART_INTERVAL entries. An
+// insert or erase lays out only the group it changes again and moves the bytes
+// after it; a group that overflows is cut in two. How many entries a page holds
+// follows from the bytes they take, not from a fixed count. The first entry of
+// every page is kept in memory, so locating a page costs no reads.
+template<int page_bytes = 4096, typename Storage = FileStorage>
+requires (random_access_storage<Storage> && page_bytes >= 1024 && page_bytes <= 65536)
+class StringBlockList {
+ public:
+  struct Entry {
+    std::string key;
+    int value;
+    bool operator < (const Entry &other) const {
+      int i = key.compare(other.key);
+      return i ? i < 0 : value < other.value;
+    }
+  };
+ private:
+  static const int RESTART_INTERVAL = 16;
+  static const size_t MAX_KEY = 255;
+  struct Header {
+    int next, prev;
+    unsigned short count, restarts, used;
+  };
+  // entries grow from the front of data, the restart offsets back from its end
+  struct Page {
+    Header header;
+    char data[page_bytes - sizeof(Header)];
+  };
+  static const int CAPACITY = sizeof(Page::data);
+  // pages start on a PAGE_BYTES boundary, or on one of their own size if they are
+  // smaller, so none of them straddles more kernel pages than it has to
+  static constexpr size_t ALIGNMENT = page_bytes % PAGE_BYTES == 0 ? PAGE_BYTES :
+                                      PAGE_BYTES % page_bytes == 0 ? page_bytes : 1;
+  // the first page's prev is the root slot, which takes the place of a next field
+  static_assert(offsetof(Header, next) == 0, "Unexpected alignment");
+  // the first page and the head of the chain of released pages
+  static const int ROOT = 0;
+  static const int FREE_LIST = sizeof(int);
+  struct IndexEntry {
+    Entry first;
+    int place;
+  };
+  Storage storage_handler;
+  std::vector<IndexEntry> index;
+  static unsigned short restart_at(const Page &page, int i) {
+    unsigned short offset;
+    std::memcpy(&offset, page.data + CAPACITY - (i + 1) * sizeof(offset), sizeof(offset));
+    return offset;
+  }
+  static void set_restart(Page &page, int i, unsigned short offset) {
+    std::memcpy(page.data + CAPACITY - (i + 1) * sizeof(offset), &offset, sizeof(offset));
+  }
+  // where restart group i ends, the next one or the used bytes starting there
+  static int group_end(const Page &page, int i) {
+    return i + 1 < page.header.restarts ? restart_at(page, i + 1) : page.header.used;
+  }
+  // Decodes the entry at offset into key, which has to hold the previous key,
+  // and returns the offset of the next one.
+  static int decode(const Page &page, int offset, std::string &key, int &value) {
+    unsigned char shared = page.data[offset], unshared = page.data[offset + 1];
+    key.resize(shared);
+    key.append(page.data + offset + 2, unshared);
+    std::memcpy(&value, page.data + offset + 2 + unshared, sizeof(value));
+    return offset + 2 + unshared + sizeof(value);
+  }
+  static void decode(const Page &page, std::vector<Entry> &entries) {
+    Entry entry{std::string(), 0};
+    for (int i = 0, offset = 0; i < page.header.count; i++) {
+      offset = decode(page, offset, entry.key, entry.value);
+      entries.push_back(entry);
+    }
+  }
+  static void decode_group(const Page &page, int i, std::vector<Entry> &entries) {
+    Entry entry{std::string(), 0};
+    for (int offset = restart_at(page, i), end = group_end(page, i); offset < end; ) {
+      offset = decode(page, offset, entry.key, entry.value);
+      entries.push_back(entry);
+    }
+  }
+  // the last restart group whose first entry does not sort after x, the first
+  // one if all of them do
+  static int group_of(const Page &page, const Entry &x) {
+    Entry first{std::string(), 0};
+    int l = 0, r = page.header.restarts - 1;
+    while (l < r) {
+      int mid = (l + r + 1) / 2;
+      decode(page, restart_at(page, mid), first.key, first.value);
+      if (x < first) {
+        r = mid - 1;
+      } else {
+        l = mid;
+      }
+    }
+    return l;
+  }
+  static size_t shared_prefix(const std::string &x, const std::string &y) {
+    size_t i = 0;
+    while (i < x.size() && i < y.size() && x[i] == y[i]) i++;
+    return i;
+  }
+  // bytes entry takes in a page that starts at first, its restart slot included
+  static int entry_size(const Entry *first, const Entry *entry) {
+    if ((entry - first) % RESTART_INTERVAL == 0) {
+      return 2 + entry->key.size() + sizeof(int) + sizeof(unsigned short);
+    }
+    return 2 + (entry->key.size() - shared_prefix(entry[-1].key, entry->key)) + sizeof(int);
+  }
+  static int encoded_size(const Entry *first, const Entry *last) {
+    int bytes = 0;
+    for (const Entry *entry = first; entry != last; entry++) {
+      bytes += entry_size(first, entry);
+    }
+    return bytes;
+  }
+  // lays [first, last) out from out on as one restart group and returns the
+  // bytes it took
+  static int encode_group(const Entry *first, const Entry *last, char *out) {
+    int offset = 0;
+    for (const Entry *entry = first; entry != last; entry++) {
+      size_t shared = entry == first ? 0 : shared_prefix(entry[-1].key, entry->key);
+      out[offset] = static_cast<char>(shared);
+      out[offset + 1] = static_cast<char>(entry->key.size() - shared);
+      std::memcpy(out + offset + 2, entry->key.data() + shared, entry->key.size() - shared);
+      offset += 2 + entry->key.size() - shared;
+      std::memcpy(out + offset, &entry->value, sizeof(entry->value));
+      offset += sizeof(entry->value);
+    }
+    return offset;
+  }
+  // lays [first, last) out in page, keeping its links; false if they do not fit
+  static bool encode(const Entry *first, const Entry *last, Page &page) {
+    if (encoded_size(first, last) > CAPACITY) return false;
+    int offset = 0, restarts = 0;
+    for (const Entry *group = first; group != last; ) {
+      const Entry *end = last - group > RESTART_INTERVAL ? group + RESTART_INTERVAL : last;
+      set_restart(page, restarts++, offset);
+      offset += encode_group(group, end, page.data + offset);
+      group = end;
+    }
+    page.header.count = last - first;
+    page.header.restarts = restarts;
+    page.header.used = offset;
+    return true;
+  }
+  // Lays entries out in place of restart group i, moving the bytes after it and
+  // the slots of the later groups. Past RESTART_INTERVAL entries they make two
+  // groups, and none takes the group away. The count is left to the caller. False,
+  // with the page untouched, if they do not fit.
+  static bool splice(Page &page, int i, const std::vector<Entry> &entries) {
+    char buffer[(RESTART_INTERVAL + 1) * (2 + MAX_KEY + sizeof(int))];
+    const Entry *first = entries.data(), *last = first + entries.size();
+    const Entry *middle = last - first > RESTART_INTERVAL ? first + (last - first) / 2 : last;
+    int groups = first == last ? 0 : middle == last ? 1 : 2;
+    int split = encode_group(first, middle, buffer);
+    int bytes = split + encode_group(middle, last, buffer + split);
+    int begin = restart_at(page, i), end = group_end(page, i);
+    int used = page.header.used + bytes - (end - begin), restarts = page.header.restarts + groups - 1;
+    if (used + restarts * static_cast<int>(sizeof(unsigned short)) > CAPACITY) return false;
+    std::memmove(page.data + begin + bytes, page.data + end, page.header.used - end);
+    std::memcpy(page.data + begin, buffer, bytes);
+    for (int j = i + 1; j < page.header.restarts; j++) {
+      set_restart(page, j, restart_at(page, j) + begin + bytes - end);
+    }
+    char *slots = page.data + CAPACITY - page.header.restarts * sizeof(unsigned short);
+    std::memmove(slots - (groups - 1) * static_cast<int>(sizeof(unsigned short)), slots,
+                 (page.header.restarts - i - 1) * sizeof(unsigned short));
+    if (groups > 0) set_restart(page, i, begin);
+    if (groups > 1) set_restart(page, i + 1, begin + split);
+    page.header.restarts = restarts;
+    page.header.used = used;
+    return true;
+  }
+  // last page that may hold x, the first one if x sorts before all of them
+  int find_slot(const Entry &x) const {
+    int l = 0, r = index.size();
+    while (l < r) {
+      int mid = (l + r) / 2;
+      if (x < index[mid].first) {
+        r = mid;
+      } else {
+        l = mid + 1;
+      }
+    }
+    return std::max(l - 1, 0);
+  }
+  // the used head of a page and its slot directory; the gap between them is never read
+  static WriteRequest head_of(int place, const Page &page) {
+    return WriteRequest(place, reinterpret_cast<const char*>(&page), sizeof(Header) + page.header.used);
+  }
+  static WriteRequest slots_of(int place, const Page &page) {
+    int bytes = page.header.restarts * sizeof(unsigned short);
+    return WriteRequest(place + sizeof(Page) - bytes, page.data + CAPACITY - bytes, bytes);
+  }
+  void write_page(int place, const Page &page) {
+    storage_handler.write_batch({head_of(place, page), slots_of(place, page)});
+  }
+  void unlink(const Page &page) {
+    if (page.header.next) {
+      storage_handler.write_batch({WriteRequest(page.header.prev + offsetof(Header, next), page.header.next),
+                                   WriteRequest(page.header.next + offsetof(Header, prev), page.header.prev)});
+    } else {
+      storage_handler.write_at(page.header.prev + offsetof(Header, next), page.header.next);
+    }
+  }
+  // Writes entries back to the page at index[slot], which they came from, in whole
+  // restart groups, splitting the page if they overflow it. An erase may need a
+  // split as well: it moves later entries onto restarts, where they are stored whole.
+  void store(int slot, Page &page, const std::vector<Entry> &entries) {
+    int place = index[slot].place;
+    const Entry *first = entries.data(), *last = first + entries.size();
+    if (encode(first, last, page)) {
+      write_page(place, page);
+      index[slot].first = entries.front();
+      return;
+    }
+    // split where the bytes, not the entries, are halved; the right half starts
+    // over with a whole key, so it may need to give up a little more
+    int half = encoded_size(first, last) / 2, bytes = 0;
+    const Entry *middle = first;
+    while (middle + 1 < last && bytes < half) {
+      bytes += entry_size(first, middle++);
+    }
+    Page right;
+    right.header.next = page.header.next;
+    right.header.prev = place;
+    while (!encode(middle, last, right) && middle + 1 < last) middle++;
+    if (!encode(first, middle, page)) throw sjtu::runtime_error();
+    int right_place = storage_handler.allocate(sizeof(Page), ALIGNMENT);
+    page.header.next = right_place;
+    if (right.header.next) {
+      storage_handler.write_batch({head_of(right_place, right), slots_of(right_place, right),
+                                   head_of(place, page), slots_of(place, page),
+                                   WriteRequest(right.header.next + offsetof(Header, prev), right_place)});
+    } else {
+      storage_handler.write_batch({head_of(right_place, right), slots_of(right_place, right),
+                                   head_of(place, page), slots_of(place, page)});
+    }
+    index[slot].first = entries.front();
+    index.insert(index.begin() + slot + 1, IndexEntry{*middle, right_place});
+  }
+  static void check(std::string_view key) {
+    if (key.size() > MAX_KEY) throw sjtu::runtime_error();
+  }
+ public:
+  StringBlockList(const char *name) : storage_handler(name) {
+    if (storage_handler.file_size() < FREE_LIST + static_cast<int>(sizeof(int))) {
+      int const root[2] = {0, 0};
+      storage_handler.write_at(ROOT, root);
+    }
+    storage_handler.track_free_blocks(sizeof(Page), FREE_LIST);
+    Page page;
+    int place;
+    storage_handler.read_at(ROOT, place);
+    while (place) {
+      storage_handler.read_at(place, page);
+      Entry first{std::string(), 0};
+      decode(page, 0, first.key, first.value);
+      index.push_back(IndexEntry{first, place});
+      place = page.header.next;
+    }
+  }
+  StringBlockList(const StringBlockList &) = delete;
+  StringBlockList& operator = (const StringBlockList &) = delete;
+  // calls function(value) for every entry under key, in order of value
+  template<typename Function>
+  void for_each(std::string_view key, Function function) {
+    if (index.empty()) return;
+    const Entry begin{std::string(key), INT_MIN};
+    Page page;
+    std::string current;
+    int value;
+    for (int slot = find_slot(begin); slot < static_cast<int>(index.size()); slot++) {
+      storage_handler.read_at(index[slot].place, page);
+      // the last restart whose key sorts before key; decoding starts there
+      int l = 0, r = page.header.restarts;
+      while (r - l > 1) {
+        int mid = (l + r) / 2;
+        decode(page, restart_at(page, mid), current, value);
+        if (current < key) {
+          l = mid;
+        } else {
+          r = mid;
+        }
+      }
+      current.clear();
+      for (int offset = restart_at(page, l); offset < page.header.used; ) {
+        offset = decode(page, offset, current, value);
+        int order = std::string_view(current).compare(key);
+        if (order > 0) return;
+        if (order == 0) function(value);
+      }
+    }
+  }
+  vector<int> find(std::string_view key) {
+    vector<int> ret{};
+    for_each(key, [&] (int value) { ret.push_back(value); });
+    return ret;
+  }
+  void insert(std::string_view key, int value) {
+    check(key);
+    OperationGuard guard(storage_handler);
+    Entry x{std::string(key), value};
+    Page page;
+    if (index.empty()) {
+      page.header.next = 0;
+      page.header.prev = ROOT;
+      encode(&x, &x + 1, page);
+      int place = storage_handler.allocate(sizeof(Page), ALIGNMENT);
+      write_page(place, page);
+      storage_handler.write_at(ROOT, place);
+      index.push_back(IndexEntry{x, place});
+      return;
+    }
+    int slot = find_slot(x), place = index[slot].place;
+    storage_handler.read_at(place, page);
+    int group = group_of(page, x);
+    std::vector<Entry> entries;
+    decode_group(page, group, entries);
+    entries.insert(std::upper_bound(entries.begin(), entries.end(), x), x);
+    if (splice(page, group, entries)) {
+      page.header.count++;
+      write_page(place, page);
+      if (group == 0) index[slot].first = entries.front();
+      return;
+    }
+    entries.clear();
+    decode(page, entries);
+    entries.insert(std::upper_bound(entries.begin(), entries.end(), x), x);
+    store(slot, page, entries);
+  }
+  void erase(std::string_view key, int value) {
+    if (index.empty() || key.size() > MAX_KEY) return;
+    OperationGuard guard(storage_handler);
+    Entry x{std::string(key), value};
+    int slot = find_slot(x), place = index[slot].place;
+    Page page;
+    storage_handler.read_at(place, page);
+    int group = group_of(page, x);
+    std::vector<Entry> entries;
+    decode_group(page, group, entries);
+    auto it = std::lower_bound(entries.begin(), entries.end(), x);
+    if (it == entries.end() || x < *it) return;
+    if (page.header.count == 1) {
+      unlink(page);
+      storage_handler.release(place, sizeof(Page));
+      index.erase(index.begin() + slot);
+      return;
+    }
+    entries.erase(it);
+    // the entry after an erased restart is stored whole, which may not fit
+    if (splice(page, group, entries)) {
+      page.header.count--;
+      write_page(place, page);
+      if (group == 0) decode(page, 0, index[slot].first.key, index[slot].first.value);
+      return;
+    }
+    entries.clear();
+    decode(page, entries);
+    entries.erase(std::lower_bound(entries.begin(), entries.end(), x));
+    store(slot, page, entries);
+  }
+};
+
+#endif
@@ -0,0 +1,51 @@
+#include "blockblocklist.hpp"
+#include "test_common.hpp"
+#include <climits>
+#include <random>
+#include <set>
+#include <vector>
+// BlockBlockList batches against std::multiset: keys repeat within a batch and
+// spread over several leaves and head blocks, and a batch has to leave what its
+// entries one at a time would.
+template<typename List>
+void check_contents(List &list, const std::multiset<int> &expected) {
+  vector<int> found = list.find(INT_MIN, INT_MAX);
+  check(found.size() == expected.size(), "size");
+  auto it = expected.begin();
+  for (size_t i = 0; i < found.size(); i++, ++it) check(found[i] == *it, "contents");
+}
+int main() {
+  std::remove("test_batch.db");
+  {
+    // seven 0s over three leaves, then 1s
+    BlockBlockList<int, 40, FileStorage> list("test_batch.db");
+    std::vector<int> sorted{0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1};
+    list.bulk_load(sorted.begin(), sorted.end(), 3);
+    std::vector<int> batch{0, 0};
+    list.erase_batch(batch.begin(), batch.end());
+    check_contents(list, std::multiset<int>{0, 0, 0, 0, 0, 1, 1, 1, 1});
+  }
+  std::remove("test_batch.db");
+  std::mt19937 random(12);
+  std::multiset<int> expected;
+  BlockBlockList<int, 40, FileStorage> list("test_batch.db");
+  for (int round = 0; round < 300; round++) {
+    std::vector<int> batch;
+    int count = random() % 400;
+    for (int i = 0; i < count; i++) batch.push_back(random() % 100);
+    if (round % 3 != 2) {
+      list.insert_batch(batch.begin(), batch.end());
+      expected.insert(batch.begin(), batch.end());
+    } else {
+      list.erase_batch(batch.begin(), batch.end());
+      for (int x : batch) {
+        auto it = expected.find(x);
+        if (it != expected.end()) expected.erase(it);
+      }
+    }
+    check_contents(list, expected);
+  }
+  std::remove("test_batch.db");
+  std::printf("PASSED\n");
+  return 0;
+}
@@ -0,0 +1,71 @@
+#include "blockblocklist.hpp"
+#include "test_common.hpp"
+#include <algorithm>
+#include <climits>
+#include <memory>
+#include <random>
+#include <vector>
+// Bulk loads of a BlockList and a BlockBlockList: input in any order, sorted in
+// runs small enough that many of them spill to files, comes out the same as the
+// sorted input loaded directly, and input out of order is turned away.
+using List = BlockList<int, 40, FileStorage>;
+using Tree = BlockBlockList<int, 40, FileStorage>;
+std::vector<int> contents(List &list) {
+  std::vector<int> seen;
+  list.for_each([&] (int x) { seen.push_back(x); });
+  return seen;
+}
+std::vector<int> contents(Tree &tree) {
+  vector<int> found = tree.find(INT_MIN, INT_MAX);
+  std::vector<int> seen;
+  for (size_t i = 0; i < found.size(); i++) seen.push_back(found[i]);
+  return seen;
+}
+// loads the input sorted, unsorted and out of order into fresh containers made
+// by open
+template<typename Open>
+void loads(const std::vector<int> &input, Open open) {
+  std::vector<int> sorted(input);
+  std::sort(sorted.begin(), sorted.end());
+  for (int fill : {1, 7, 40}) {
+    {
+      auto container = open();
+      container->bulk_load(sorted.begin(), sorted.end(), fill);
+      check(contents(*container) == sorted, "sorted load");
+    }
+    {
+      // 64 entries a run: the input goes out to dozens of files
+      auto container = open();
+      container->bulk_load_unsorted(input.begin(), input.end(), fill, 64 * sizeof(int));
+      check(contents(*container) == sorted, "unsorted load");
+    }
+  }
+  std::vector<int> descending{3, 2, 1};
+  auto container = open();
+  bool thrown = false;
+  try {
+    container->bulk_load(descending.begin(), descending.end());
+  } catch (const sjtu::runtime_error &) {
+    thrown = true;
+  }
+  check(thrown, "out of order input taken");
+}
+int main() {
+  const char *name = "test_bulk_load.db";
+  std::mt19937 random(11);
+  std::vector<int> input;
+  for (int i = 0; i < 5000; i++) input.push_back(random() % 700);
+  loads(input, [&] {
+    std::remove(name);
+    auto list = std::make_unique<List>(sizeof(int), name);
+    list->build_index();
+    return list;
+  });
+  loads(input, [&] {
+    std::remove(name);
+    return std::make_unique<Tree>(name);
+  });
+  std::remove(name);
+  std::printf("PASSED\n");
+  return 0;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#ifndef BPT_TEST_COMMON_
+#define BPT_TEST_COMMON_
+
+#include <cstdio>
+#include <cstdlib>
+
+// What every test executable shares. A test prints PASSED at the end; the first
+// check that fails names what it checked and ends the process with status 1.
+inline void check(bool condition, const char *what) {
+  if (!condition) {
+    std::printf("FAILED: %s\n", what);
+    std::exit(1);
+  }
+}
+
+#endif
@@ -0,0 +1,100 @@
+#include "blockblocklist.hpp"
+#include "test_common.hpp"
+#include <atomic>
+#include <climits>
+#include <random>
+#include <thread>
+#include <vector>
+// BlockBlockList in concurrent mode: every writer owns the keys congruent to its
+// number, inserts them in order and erases every third one again, while readers
+// look keys up and scan ranges. A key its writer has published as inserted, and
+// never erases, has to be found by any reader that looks afterwards. First a
+// single thread checks that a scan copes with the leaves it copied going stale.
+using Entry = trivial_pair<int, int>;
+int const WRITERS = 4, READERS = 4, KEYS = 20000;
+bool kept(int key) {
+  return key / WRITERS % 3 != 0;
+}
+// A scan stops partway, the leaves right after the one it stands on are emptied,
+// which frees them, and entries far away take their places. Going on, the scan
+// has to notice its copy is stale rather than follow it into the reused blocks.
+void stale_copies() {
+  std::remove("test_concurrent_stale.db");
+  BlockBlockList<Entry, 40, FileStorage, true> list("test_concurrent_stale.db");
+  int const EVEN = 4000, FAR = 1000000, SPAN = 8 * 40 * 2;
+  for (int key = 0; key < EVEN; key += 2) list.insert(make_trivial_pair(key, 0));
+  auto cursor = list.scan(make_trivial_pair(INT_MIN, INT_MIN), make_trivial_pair(INT_MAX, INT_MAX));
+  std::vector<int> seen;
+  for (int i = 0; i < 100; i++, ++cursor) seen.push_back(cursor->first);
+  int last = seen.back();
+  for (int key = last + 2; key <= last + SPAN; key += 2) list.erase(make_trivial_pair(key, 0));
+  for (int i = 0; i < 400; i++) list.insert(make_trivial_pair(FAR + i, 0));
+  for (; cursor; ++cursor) {
+    check(cursor->first > seen.back(), "a stale scan goes out of order");
+    seen.push_back(cursor->first);
+  }
+  // entries erased after the scan copied their leaf may still show; nothing else
+  size_t i = 100;
+  while (i < seen.size() && seen[i] <= last + SPAN) i++;
+  for (int key = last + SPAN + 2; key < EVEN; key += 2, i++) {
+    check(i < seen.size() && seen[i] == key, "a stale scan misses entries");
+  }
+  for (int key = FAR; key < FAR + 400; key++, i++) {
+    check(i < seen.size() && seen[i] == key, "a stale scan misses new entries");
+  }
+  check(i == seen.size(), "a stale scan returns too much");
+}
+int main() {
+  stale_copies();
+  std::remove("test_concurrent.db");
+  BlockBlockList<Entry, 40, FileStorage, true> list("test_concurrent.db");
+  std::atomic<int> published[WRITERS];
+  for (int w = 0; w < WRITERS; w++) published[w] = -1;
+  std::atomic<bool> stop{false};
+  std::atomic<int> failures{0};
+  std::vector<std::thread> threads;
+  for (int w = 0; w < WRITERS; w++) {
+    threads.emplace_back([&, w] {
+      for (int i = 0; i * WRITERS + w < KEYS; i++) {
+        int key = i * WRITERS + w;
+        list.insert(make_trivial_pair(key, key * 7));
+        if (!kept(key)) list.erase(make_trivial_pair(key, key * 7));
+        published[w].store(i, std::memory_order_release);
+      }
+    });
+  }
+  for (int r = 0; r < READERS; r++) {
+    threads.emplace_back([&, r] {
+      std::mt19937 rng(r);
+      while (!stop.load(std::memory_order_relaxed)) {
+        int w = rng() % WRITERS, done = published[w].load(std::memory_order_acquire);
+        if (done < 0) continue;
+        int key = rng() % (done + 1) * WRITERS + w;
+        auto found = list.find(make_trivial_pair(key, INT_MIN), make_trivial_pair(key, INT_MAX));
+        if (kept(key) != (found.size() == 1) || (found.size() == 1 && found[0].second != key * 7)) failures++;
+        int begin = rng() % KEYS, count = 0, last = INT_MIN;
+        for (auto cursor = list.scan(make_trivial_pair(begin, INT_MIN), make_trivial_pair(begin + 300, INT_MAX));
+             cursor; ++cursor) {
+          if (cursor->first <= last || cursor->first < begin || cursor->first > begin + 300) failures++;
+          last = cursor->first;
+          count++;
+        }
+        if (count > 301) failures++;
+      }
+    });
+  }
+  for (int w = 0; w < WRITERS; w++) threads[w].join();
+  stop = true;
+  for (size_t i = WRITERS; i < threads.size(); i++) threads[i].join();
+  check(failures == 0, "readers saw a wrong state");
+  int expected = 0;
+  auto cursor = list.scan(make_trivial_pair(INT_MIN, INT_MIN), make_trivial_pair(INT_MAX, INT_MAX));
+  for (int key = 0; key < KEYS; key++) {
+    if (!kept(key)) continue;
+    check(cursor && cursor->first == key && cursor->second == key * 7, "final contents");
+    ++cursor;
+    expected++;
+  }
+  check(!cursor, "final contents hold nothing else");
+  std::printf("PASSED %d entries\n", expected);
+}
@@ -0,0 +1,119 @@
+#include "list.hpp"
+#include "test_common.hpp"
+#include <random>
+#include <set>
+#include <vector>
+#include <sys/stat.h>
+// Space held by a BlockList under churn: blocks that empty go back to be reused
+// before the file grows, and compact() writes the live entries into a fresh
+// file packed in key order. Batches, with keys repeated within them and across
+// blocks, leave what the same entries one at a time would.
+using List = BlockList<int, 40, FileStorage>;
+long long bytes(const char *name) {
+  struct stat st;
+  check(::stat(name, &st) == 0, "stat");
+  return st.st_size;
+}
+void check_contents(List &list, const std::multiset<int> &expected) {
+  std::vector<int> seen;
+  int last = -1;
+  list.for_each([&] (int x) {
+    check(last <= x, "entries out of order");
+    last = x;
+    seen.push_back(x);
+  });
+  check(seen.size() == expected.size() && std::equal(seen.begin(), seen.end(), expected.begin()), "contents");
+  auto found = list.find(1000, 1999);
+  check(static_cast<long>(found.size()) ==
+        std::distance(expected.lower_bound(1000), expected.upper_bound(1999)), "find");
+}
+void batches() {
+  std::remove("test_list_batch.db");
+  {
+    // seven 0s over three blocks, then 1s; the batch has to find the 0s in the
+    // blocks before the one it starts in
+    List list(sizeof(int), "test_list_batch.db");
+    list.build_index();
+    std::vector<int> sorted{0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1};
+    list.bulk_load(sorted.begin(), sorted.end(), 3);
+    std::vector<int> batch{0, 0};
+    list.erase_batch(batch.begin(), batch.end());
+    check_contents(list, std::multiset<int>{0, 0, 0, 0, 0, 1, 1, 1, 1});
+  }
+  std::remove("test_list_batch.db");
+  std::mt19937 random(12);
+  std::multiset<int> expected;
+  List list(sizeof(int), "test_list_batch.db");
+  list.build_index();
+  for (int round = 0; round < 200; round++) {
+    std::vector<int> batch;
+    int count = random() % 300;
+    for (int i = 0; i < count; i++) batch.push_back(random() % 60);
+    if (round % 3 != 2) {
+      list.insert_batch(batch.begin(), batch.end());
+      expected.insert(batch.begin(), batch.end());
+    } else {
+      list.erase_batch(batch.begin(), batch.end());
+      for (int x : batch) {
+        auto it = expected.find(x);
+        if (it != expected.end()) expected.erase(it);
+      }
+    }
+    check_contents(list, expected);
+  }
+  std::remove("test_list_batch.db");
+}
+int main() {
+  batches();
+  std::remove("test_list.db");
+  std::remove("test_list_compact.db");
+  std::mt19937 random(6);
+  std::multiset<int> expected;
+  {
+    List list(sizeof(int), "test_list.db");
+    list.build_index();
+    std::vector<int> keys;
+    for (int i = 0; i < 20000; i++) keys.push_back(random() % 50000);
+    for (int x : keys) list.insert(x);
+    long long grown = 0;
+    // Emptying every block and filling the list again takes no new space.
+    for (int round = 0; round < 3; round++) {
+      std::shuffle(keys.begin(), keys.end(), random);
+      for (int x : keys) list.erase(x);
+      check(list.chain_length() == 0, "list not emptied");
+      for (int x : keys) list.insert(x);
+      if (round == 0) {
+        grown = bytes("test_list.db");
+      } else {
+        check(bytes("test_list.db") == grown, "released blocks not reused");
+      }
+    }
+    // Erasing most entries leaves blocks sparse but holds on to them.
+    std::shuffle(keys.begin(), keys.end(), random);
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (i % 10 == 0) {
+        expected.insert(keys[i]);
+      } else {
+        list.erase(keys[i]);
+      }
+    }
+    check_contents(list, expected);
+    list.compact("test_list_compact.db");
+  }
+  List list(sizeof(int), "test_list_compact.db");
+  list.build_index();
+  check_contents(list, expected);
+  int blocks = (expected.size() + 39) / 40;
+  check(list.chain_length() == blocks, "compacted blocks not full");
+  check(bytes("test_list_compact.db") <= static_cast<long long>((blocks + 1) * PAGE_BYTES), "compacted file not packed");
+  // the compacted list takes changes as any other
+  for (int x = 0; x < 1000; x++) {
+    list.insert(x);
+    expected.insert(x);
+  }
+  check_contents(list, expected);
+  std::remove("test_list.db");
+  std::remove("test_list_compact.db");
+  std::printf("PASSED\n");
+  return 0;
+}
@@ -0,0 +1,105 @@
+#include "unique_map.hpp"
+#include "test_common.hpp"
+#include <atomic>
+#include <thread>
+#include <vector>
+// ShardedUniqueMap: keys go to the shard their hash picks and nowhere else,
+// batches spread over every shard at once, and updates from several threads
+// to the same keys all land. An exception on any shard reaches the caller.
+using Map = ShardedUniqueMap<int, int>;
+const char *NAME = "test_sharded";
+void remove_files() {
+  for (int part = 0; part < 8; part++) {
+    std::remove((string(NAME) + "_map1_" + std::to_string(part)).c_str());
+    std::remove((string(NAME) + "_map2_" + std::to_string(part)).c_str());
+  }
+}
+void routing() {
+  std::vector<int> counts(8);
+  for (int key = 0; key < 8000; key++) {
+    int part = Map::shard_of(key);
+    check(part >= 0 && part < 8, "shard out of range");
+    check(part == Map::shard_of(key), "shard not stable");
+    counts[part]++;
+  }
+  for (int count : counts) check(count > 500, "keys bunched on few shards");
+  {
+    Map map(NAME);
+    for (int key = 0; key < 200; key++) map.insert(key, key * 3);
+  }
+  // each key is found in the files of its own shard only
+  for (int part = 0; part < 8; part++) {
+    UniqueMap<int, int> shard(NAME, part);
+    for (int key = 0; key < 200; key++) {
+      bool found = !shard[key].empty();
+      check(found == (Map::shard_of(key) == part), "key in the wrong shard");
+    }
+  }
+  remove_files();
+}
+void batches() {
+  Map map(NAME);
+  std::vector<std::pair<int, int>> pairs;
+  for (int key = 0; key < 20000; key++) pairs.emplace_back(key, -key);
+  // two callers at once: their batches take turns on the workers
+  std::thread other([&] { map.insert_batch(pairs.begin() + 10000, pairs.end()); });
+  map.insert_batch(pairs.begin(), pairs.begin() + 10000);
+  other.join();
+  check(map.size() == 20000, "size after batches");
+  for (int key = 0; key < 20000; key += 37) check(map.get(key) == -key, "value after batch");
+  std::vector<int> odd;
+  for (int key = 1; key < 20000; key += 2) odd.push_back(key);
+  map.erase_batch(odd.begin(), odd.end());
+  for (int key = 0; key < 200; key++) check(map.get(key).has_value() == (key % 2 == 0), "erase batch");
+  std::atomic<long long> sum{0};
+  map.for_each([&] (int &value) { sum += value; });
+  // for_each visits every value stored, erased keys included
+  check(sum == -19999ll * 20000 / 2, "for_each");
+  check(!map.assign(1, 5) && map.assign(2, 5) && map.get(2) == 5, "assign");
+}
+void updates() {
+  Map map(NAME);
+  for (int key = 0; key < 16; key++) map.insert(key, 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 2000; i++) {
+        map.update(i % 16, [] (int &value) { value++; });
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  for (int key = 0; key < 16; key++) check(map.get(key) == 500, "update lost");
+  check(!map.update(99, [] (int &value) { value++; }), "update of a missing key");
+}
+// a shard's exception comes out of the call that ran it, on any worker
+void failures() {
+  Map map(NAME);
+  for (int key = 0; key < 200; key++) map.insert(key, key);
+  for (int part = 0; part < 8; part++) {
+    bool thrown = false;
+    try {
+      map.for_each([&] (int &value) {
+        if (Map::shard_of(value) == part) throw sjtu::runtime_error();
+      });
+    } catch (const sjtu::runtime_error &) {
+      thrown = true;
+    }
+    check(thrown, "exception of a shard lost");
+  }
+  std::vector<std::pair<int, int>> pairs{{500, 1}, {501, 2}};
+  map.insert_batch(pairs.begin(), pairs.end());
+  check(map.get(501) == 2, "workers stuck after an exception");
+}
+int main() {
+  remove_files();
+  routing();
+  batches();
+  remove_files();
+  updates();
+  remove_files();
+  failures();
+  remove_files();
+  std::printf("PASSED\n");
+  return 0;
+}
@@ -0,0 +1,103 @@
+#include "blockblocklist.hpp"
+#include "versioned.hpp"
+#include "test_common.hpp"
+#include <climits>
+#include <random>
+#include <set>
+#include <vector>
+// Snapshot isolation: a snapshot keeps reading what the storage, and a list on
+// top of it, held when it was taken, while writes go on; once it dies the pages
+// kept for it go back to be reused.
+using Entry = trivial_pair<int, int>;
+int page(VersionedStorage<> &storage, int i) {
+  int value;
+  storage.read_at(i * 4096 + 100, value);
+  return value;
+}
+void storage_versions() {
+  std::remove("test_snapshot_pages.db");
+  std::remove("test_snapshot_pages.db.versions");
+  VersionedStorage<> storage("test_snapshot_pages.db");
+  int current[8];
+  for (int i = 0; i < 8; i++) {
+    storage.write_at(i * 4096 + 100, i);
+    current[i] = i;
+  }
+  check(storage.statistics().kept == 0, "pages kept without a snapshot");
+  int slots = 0;
+  for (int round = 1; round <= 3; round++) {
+    {
+      int before[8];
+      std::copy(current, current + 8, before);
+      VersionedStorage<> old = storage.snapshot();
+      for (int i = 0; i < 4; i++) {
+        current[i] = round * 100 + i;
+        storage.write_at(i * 4096 + 100, current[i]);
+      }
+      // a second write to a page since the snapshot keeps nothing more
+      current[1] = round * 1000;
+      storage.write_at(4096 + 100, current[1]);
+      for (int i = 0; i < 8; i++) {
+        check(page(old, i) == before[i], "a snapshot reads a page as it was");
+        check(page(storage, i) == current[i], "the storage reads the page as it is");
+      }
+      check(storage.statistics().kept == 4, "each changed page is kept once");
+      bool refused = false;
+      try {
+        old.write_at(0, 0);
+      } catch (...) {
+        refused = true;
+      }
+      check(refused, "a snapshot refuses writes");
+    }
+    VersionedStorage<>::Statistics statistics = storage.statistics();
+    check(statistics.kept == 0, "closing the snapshot frees what it kept");
+    if (round == 1) slots = statistics.free;
+    check(statistics.free == slots, "later snapshots reuse the freed slots");
+  }
+}
+template<typename Cursor>
+std::vector<std::pair<int, int>> all(Cursor &&cursor) {
+  std::vector<std::pair<int, int>> entries;
+  for (; cursor; ++cursor) entries.push_back({cursor->first, cursor->second});
+  return entries;
+}
+void list_isolation() {
+  std::remove("test_snapshot.db");
+  std::remove("test_snapshot.db.versions");
+  BlockBlockList<Entry, 40, VersionedStorage<>, true> list("test_snapshot.db");
+  std::set<std::pair<int, int>> live;
+  std::mt19937 rng(7);
+  for (int i = 0; i < 5000; i++) {
+    int key = rng() % 2000;
+    list.insert(make_trivial_pair(key, i));
+    live.insert({key, i});
+  }
+  Entry const first = make_trivial_pair(INT_MIN, INT_MIN), last = make_trivial_pair(INT_MAX, INT_MAX);
+  for (int round = 0; round < 3; round++) {
+    std::vector<std::pair<int, int>> frozen(live.begin(), live.end());
+    auto snapshot = list.snapshot();
+    // enough inserts to split leaves and heads, and erases that empty whole leaves
+    for (int i = 0; i < 6000; i++) {
+      int key = rng() % 2000;
+      list.insert(make_trivial_pair(key, 100000 * (round + 1) + i));
+      live.insert({key, 100000 * (round + 1) + i});
+    }
+    for (auto it = live.lower_bound({500, INT_MIN}); it != live.end() && it->first < 700; ) {
+      list.erase(make_trivial_pair(it->first, it->second));
+      it = live.erase(it);
+    }
+    check(all(snapshot.scan(first, last)) == frozen, "a snapshot scan returns the old contents");
+    vector<Entry> part = snapshot.find(make_trivial_pair(600, INT_MIN), make_trivial_pair(600, INT_MAX));
+    size_t expected = 0;
+    for (auto &entry : frozen) expected += entry.first == 600;
+    check(part.size() == expected, "a snapshot find returns the old contents");
+    check(all(list.scan(first, last)) == std::vector<std::pair<int, int>>(live.begin(), live.end()),
+          "the live list returns the new contents");
+  }
+}
+int main() {
+  storage_versions();
+  list_isolation();
+  std::printf("PASSED\n");
+}
@@ -0,0 +1,126 @@
+#include "file.hpp"
+#include "test_common.hpp"
+#include <sys/wait.h>
+#include <unistd.h>
+// Storage backends that keep files longer than their data: a file reopened after
+// a clean close or after a crash reports the size that was written, not the
+// padding past it, and keeps the data. Reads past the end come back as zeros.
+// Runs write in a child that exits without running any destructor.
+template<typename Function>
+void crash_after(Function write) {
+  pid_t child = ::fork();
+  check(child != -1, "fork");
+  if (child == 0) {
+    write();
+    ::_exit(0);
+  }
+  int status;
+  check(::waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0, "child");
+}
+template<typename Storage>
+void reopen(const char *name) {
+  std::remove(name);
+  {
+    Storage storage(name);
+    check(!storage.initialized(), "new file initialized");
+    check(storage.file_size() == 0, "new file not empty");
+    for (int i = 0; i < 1000; i++) storage.write_at(i * sizeof(int), i);
+  }
+  {
+    Storage storage(name);
+    check(storage.initialized(), "closed file not initialized");
+    check(storage.file_size() == 1000 * sizeof(int), "size after close");
+    int value;
+    storage.read_at(999 * sizeof(int), value);
+    check(value == 999, "data after close");
+  }
+  crash_after([name] {
+    Storage *storage = new Storage(name);
+    int place = storage->extend(5000 * sizeof(int));
+    for (int i = 0; i < 5000; i++) storage->write_at(place + i * sizeof(int), 1000 + i);
+    storage->sync();
+  });
+  {
+    Storage storage(name);
+    check(storage.file_size() == 6000 * sizeof(int), "size after crash");
+    for (int i = 0; i < 6000; i += 7) {
+      int value;
+      storage.read_at(i * sizeof(int), value);
+      check(value == i, "data after crash");
+    }
+  }
+  std::remove(name);
+  {
+    FileStorage other(name);
+    other.write_at(0, 12345);
+  }
+  bool refused = false;
+  try {
+    Storage storage(name);
+  } catch (...) {
+    refused = true;
+  }
+  check(refused, "file without a header opened");
+  {
+    FileStorage other(name);
+    int value;
+    other.read_at(0, value);
+    check(other.file_size() == sizeof(int) && value == 12345, "refused file changed");
+  }
+  std::remove(name);
+}
+// Reads that run past the end of a FileStorage, one by one or in batches, see
+// zeros there.
+void read_past_end() {
+  const char *name = "test_storage_file.db";
+  std::remove(name);
+  FileStorage storage(name);
+  storage.write_at(0, 0x01020304);
+  int values[4] = {-1, -1, -1, -1};
+  storage.read(0, reinterpret_cast<char*>(values), sizeof(values));
+  check(values[0] == 0x01020304 && values[1] == 0 && values[3] == 0, "read past the end");
+  storage.read_at(100, values[0]);
+  check(values[0] == 0, "read wholly past the end");
+  // the same through preadv, for a run that crosses the end and one past it
+  int a[2] = {-1, -1}, b = -1, c = -1;
+  storage.write_at(8, 7);
+  storage.read_batch({ReadRequest(0, reinterpret_cast<char*>(a), sizeof(a)), ReadRequest(8, b), ReadRequest(100, c)});
+  check(a[0] == 0x01020304 && a[1] == 0 && b == 7 && c == 0, "batch past the end");
+  int d[3] = {-1, -1, -1};
+  storage.read_batch({ReadRequest(4, reinterpret_cast<char*>(d), sizeof(d))});
+  check(d[0] == 0 && d[1] == 7 && d[2] == 0, "vector past the end");
+  std::remove(name);
+}
+// Pages written whole through a BufferPoolStorage, more than it holds, and one
+// written in part over them, all reach the file.
+void pool_pages() {
+  const char *name = "test_storage_pool.db";
+  std::remove(name);
+  {
+    BufferPoolStorage<> storage(name);
+    int page[1024];
+    for (int p = 0; p < 300; p++) {
+      for (int i = 0; i < 1024; i++) page[i] = p * 1024 + i;
+      storage.write_at(p * 4096, page);
+    }
+    storage.write_at(5 * 4096 + 100, -1);
+  }
+  FileStorage storage(name);
+  check(storage.file_size() == 300 * 4096, "pool file size");
+  for (int p = 0; p < 300; p++) {
+    int values[1024];
+    storage.read_at(p * 4096, values);
+    for (int i = 0; i < 1024; i++) {
+      check(values[i] == (p == 5 && i == 25 ? -1 : p * 1024 + i), "page written through the pool");
+    }
+  }
+  std::remove(name);
+}
+int main() {
+  read_past_end();
+  pool_pages();
+  reopen<MmapStorage<>>("test_storage_mmap.db");
+  reopen<DirectStorage>("test_storage_direct.db");
+  std::printf("PASSED\n");
+  return 0;
+}
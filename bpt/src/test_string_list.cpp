@@ -0,0 +1,70 @@
+#include "string_list.hpp"
+#include "test_common.hpp"
+#include <random>
+#include <set>
+#include <string>
+#include <utility>
+// StringBlockList against std::multiset: keys share long prefixes, so most of
+// them are front coded, pages split and empty as entries come and go, and the
+// list reads back the same from its file.
+template<typename List>
+void check_key(List &list, const std::multiset<std::pair<std::string, int>> &expected, const std::string &key) {
+  vector<int> found = list.find(key);
+  auto it = expected.lower_bound({key, INT_MIN});
+  for (size_t i = 0; i < found.size(); i++, ++it) {
+    check(it != expected.end() && it->first == key && it->second == found[i], "values of a key");
+  }
+  check(it == expected.end() || it->first != key, "values missing");
+}
+std::string make_key(std::mt19937 &random) {
+  std::string key = "user/" + std::to_string(random() % 40) + "/session/" + std::to_string(random() % 50);
+  if (random() % 20 == 0) key += std::string(random() % 200, 'x');
+  return key;
+}
+template<int page_bytes>
+void against_multiset(const char *name) {
+  using List = StringBlockList<page_bytes, FileStorage>;
+  std::remove(name);
+  std::mt19937 random(17);
+  std::multiset<std::pair<std::string, int>> expected;
+  std::vector<std::pair<std::string, int>> inserted;
+  {
+    List list(name);
+    for (int i = 0; i < 8000; i++) {
+      if (inserted.empty() || random() % 3 != 0) {
+        std::pair<std::string, int> entry(make_key(random), random() % 100);
+        list.insert(entry.first, entry.second);
+        expected.insert(entry);
+        inserted.push_back(entry);
+      } else {
+        // mostly entries that are there, some that are not
+        auto entry = inserted[random() % inserted.size()];
+        if (random() % 4 == 0) entry.second += 1000;
+        list.erase(entry.first, entry.second);
+        auto it = expected.find(entry);
+        if (it != expected.end()) expected.erase(it);
+      }
+      if (i % 500 == 0) check_key(list, expected, make_key(random));
+    }
+    bool refused = false;
+    try {
+      list.insert(std::string(256, 'k'), 0);
+    } catch (...) {
+      refused = true;
+    }
+    check(refused, "overlong key taken");
+  }
+  List list(name);
+  for (auto it = expected.begin(); it != expected.end(); it = expected.upper_bound({it->first, INT_MAX})) {
+    check_key(list, expected, it->first);
+  }
+  for (const auto &entry : expected) list.erase(entry.first, entry.second);
+  check(list.find(expected.begin()->first).empty(), "entries left after erasing all");
+  std::remove(name);
+}
+int main() {
+  against_multiset<4096>("test_string_list.db");
+  against_multiset<1024>("test_string_list_small.db");
+  std::printf("PASSED\n");
+  return 0;
+}
@@ -0,0 +1,65 @@
+#include "tree.hpp"
+#include "test_common.hpp"
+#include <climits>
+#include <random>
+#include <set>
+// Random inserts and erases against std::multiset, on nodes small enough that
+// leaves and internal nodes split, borrow from a neighbour and merge all the time.
+using Tree = BPlusTree<int, 8>;
+void check_range(Tree &tree, const std::multiset<int> &expected, int begin, int end) {
+  vector<int> found = tree.find(begin, end);
+  auto it = expected.lower_bound(begin);
+  for (size_t i = 0; i < found.size(); i++, ++it) {
+    check(it != expected.end() && *it == found[i], "range contents");
+  }
+  check(it == expected.upper_bound(end), "range too short");
+}
+int main() {
+  std::remove("test_tree.db");
+  std::mt19937 random(8);
+  std::multiset<int> expected;
+  {
+    Tree tree("test_tree.db");
+    int tallest = 0;
+    for (int round = 0; round < 4; round++) {
+      // grow well past a few levels, then shrink, with the other operation mixed in
+      for (int i = 0; i < 20000; i++) {
+        int x = random() % 5000;
+        bool inserting = round % 2 == 0 ? random() % 4 != 0 : random() % 4 == 0;
+        if (inserting) {
+          tree.insert(x);
+          expected.insert(x);
+        } else {
+          tree.erase(x);
+          auto it = expected.find(x);
+          if (it != expected.end()) expected.erase(it);
+        }
+        if (i % 1000 == 0) {
+          int begin = random() % 5000;
+          check_range(tree, expected, begin, begin + 200);
+        }
+        tallest = std::max(tallest, tree.height());
+      }
+      check_range(tree, expected, INT_MIN, INT_MAX);
+    }
+    check(tallest >= 4, "tree stayed too low to split internal nodes");
+    for (int x = 0; x < 5000; x++) {
+      while (expected.count(x)) {
+        tree.erase(x);
+        expected.erase(expected.find(x));
+      }
+      if (x % 500 == 0) check_range(tree, expected, INT_MIN, INT_MAX);
+    }
+    check(tree.height() == 0, "emptied tree kept nodes");
+    for (int x = 0; x < 3000; x++) {
+      tree.insert(x * 7 % 3000);
+      expected.insert(x * 7 % 3000);
+    }
+  }
+  // the tree reads back from its file
+  Tree tree("test_tree.db");
+  check_range(tree, expected, INT_MIN, INT_MAX);
+  std::remove("test_tree.db");
+  std::printf("PASSED\n");
+  return 0;
+}
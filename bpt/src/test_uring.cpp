@@ -0,0 +1,72 @@
+#include "file.hpp"
+#include "test_common.hpp"
+#include <cerrno>
+#include <vector>
+// UringStorage, through the ring and through the pread/pwrite fallback: the
+// synchronous calls read back what was written and zeros past the end, submitted
+// requests run their callbacks with the bytes moved or -errno, and more of them
+// than the ring holds all complete.
+using Storage = UringStorage<4>;
+void synchronous(Storage &storage) {
+  storage.write_at(0, 1234);
+  int value = 0;
+  storage.read_at(0, value);
+  check(value == 1234, "read after write");
+  int values[4] = {-1, -1, -1, -1};
+  storage.read(0, reinterpret_cast<char*>(values), sizeof(values));
+  check(values[0] == 1234 && values[1] == 0 && values[3] == 0, "read past the end");
+  int a = 5, b = 6, c = 0, d = 0;
+  storage.write_batch({WriteRequest(100, a), WriteRequest(8000, b)});
+  storage.read_batch({ReadRequest(100, c), ReadRequest(8000, d)});
+  check(c == 5 && d == 6, "batches");
+  check(storage.file_size() == 8000 + static_cast<int>(sizeof(int)), "size");
+}
+void submitted(Storage &storage) {
+  // twenty-five times the ring's depth, each checked by its own callback
+  const int COUNT = 100;
+  std::vector<int> written(COUNT), read(COUNT, -1), results(COUNT, -1);
+  for (int i = 0; i < COUNT; i++) {
+    written[i] = i * 7;
+    storage.submit_write(i * 4096, reinterpret_cast<const char*>(&written[i]), sizeof(int),
+                         [&results, i] (int result) { results[i] = result; });
+  }
+  storage.submit();
+  storage.drain();
+  for (int i = 0; i < COUNT; i++) check(results[i] == sizeof(int), "write callback");
+  int done = 0;
+  for (int i = 0; i < COUNT; i++) {
+    storage.submit_read(i * 4096, reinterpret_cast<char*>(&read[i]), sizeof(int),
+                        [&done, &results, i] (int result) { results[i] = result; done++; });
+  }
+  while (done < COUNT) storage.complete();
+  for (int i = 0; i < COUNT; i++) check(results[i] == sizeof(int) && read[i] == i * 7, "read callback");
+  // a bad buffer fails the request, and only it
+  int failed = 0, good = -1;
+  storage.submit_read(0, nullptr, sizeof(int), [&failed] (int result) { failed = result; });
+  storage.submit_read(0, reinterpret_cast<char*>(&good), sizeof(int), nullptr);
+  storage.drain();
+  check(failed == -EFAULT, "errno of a failed request");
+  check(good == 0, "request after a failed one");
+}
+void run(bool ring) {
+  const char *name = "test_uring.db";
+  std::remove(name);
+  {
+    Storage storage(name, ring);
+    check(storage.asynchronous() == false || ring, "ring used when not wanted");
+    if (ring && !storage.asynchronous()) std::printf("no io_uring here, testing the fallback only\n");
+    synchronous(storage);
+    submitted(storage);
+  }
+  Storage storage(name, ring);
+  int value;
+  storage.read_at(8000, value);
+  check(value == 6, "data after reopening");
+  std::remove(name);
+}
+int main() {
+  run(true);
+  run(false);
+  std::printf("PASSED\n");
+  return 0;
+}
@@ -0,0 +1,97 @@
+#include "wal.hpp"
+#include "test_common.hpp"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+// Recovery from a torn log: a process writes three groups and dies before its
+// pages reach the data file, the tail of the log is then cut short or damaged,
+// and reopening has to replay the groups that are whole and drop the last one.
+using Storage = LoggedStorage<FileStorage, 1000>;
+const char *NAME = "test_wal.db";
+const char *LOG_NAME = "test_wal.db.wal";
+// group g writes g * 100 + page at byte 8 of pages 2g - 2 .. 2g + 1 and commits
+void write_group(Storage &storage, int g) {
+  for (int page = 2 * (g - 1); page < 2 * (g - 1) + 4; page++) {
+    storage.write_at(page * 4096 + 8, g * 100 + page);
+  }
+  storage.commit();
+}
+// Leaves three committed groups in the log and an empty data file, as if the
+// process died before the data file had any of them.
+void crash() {
+  std::remove(NAME);
+  std::remove(LOG_NAME);
+  pid_t child = ::fork();
+  check(child != -1, "fork");
+  if (child == 0) {
+    Storage *storage = new Storage(NAME);
+    for (int g = 1; g <= 3; g++) write_group(*storage, g);
+    ::_exit(0);
+  }
+  int status;
+  check(::waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0, "child");
+  check(::truncate(NAME, 0) == 0, "truncate data");
+}
+long long log_bytes() {
+  struct stat st;
+  check(::stat(LOG_NAME, &st) == 0, "stat log");
+  return st.st_size;
+}
+// groups 1 and 2 are back, group 3 is gone
+void check_recovered() {
+  for (int round = 0; round < 2; round++) {
+    Storage storage(NAME);
+    check(storage.file_size() == 5 * 4096 + 8 + static_cast<int>(sizeof(int)), "size after replay");
+    for (int page = 0; page < 8; page++) {
+      int expected = page < 2 ? 100 + page : page < 6 ? 200 + page : 0;
+      int value = 0;
+      if (page * 4096 + 8 < storage.file_size()) storage.read_at(page * 4096 + 8, value);
+      check(value == expected, "page after replay");
+    }
+  }
+  check(log_bytes() == 0, "log kept after replay");
+}
+int main() {
+  crash();
+  long long full = log_bytes();
+  check(full > 0, "nothing logged");
+  {
+    // all three groups replay from an intact log
+    Storage storage(NAME);
+    int value;
+    storage.read_at(7 * 4096 + 8, value);
+    check(value == 307, "intact log not replayed");
+  }
+  {
+    // a commit inside an operation is refused
+    Storage storage(NAME);
+    bool refused = false;
+    {
+      OperationGuard guard(storage);
+      storage.write_at(8, -1);
+      try {
+        storage.commit();
+      } catch (const sjtu::runtime_error &) {
+        refused = true;
+      }
+    }
+    check(refused, "commit inside an operation");
+  }
+  // the commit record of the last group is cut short
+  crash();
+  check(::truncate(LOG_NAME, full - 10) == 0, "truncate log");
+  check_recovered();
+  // a page of the last group is damaged
+  crash();
+  int fd = ::open(LOG_NAME, O_RDWR);
+  check(fd != -1, "open log");
+  char byte = 0x5a;
+  check(::pwrite(fd, &byte, 1, full - 100) == 1, "damage log");
+  ::close(fd);
+  check_recovered();
+  std::remove(NAME);
+  std::remove(LOG_NAME);
+  std::printf("PASSED\n");
+  return 0;
+}
@@ -5,45 +5,418 @@
 
 #include <string>
 #include <iostream>
+#include <cstddef>
+#include <algorithm>
 #include "file.hpp"
-#include "list.hpp"
+#include "vector.hpp"
 #include "utility.hpp"
+#include "exceptions.hpp"
 
 template<typename Data, size_t block_size, typename Storage = FileStorage>
-requires (std::is_base_of<BasicStorage, Storage>::value && !is_sjtu_pair_with_int<Data>::value)
+requires (random_access_storage<Storage> && !is_sjtu_pair_with_int<Data>::value)
 class BPlusTree {
  private:
+  struct Header {
+    int root, height;
+  };
+  // the head of the chain of released nodes, kept by the storage right after the header
+  static const int FREE_LIST = sizeof(Header);
+  // laid out like BlockList's Block, chained through next/prev in key order
+  struct Leaf {
+    int next, prev;
+    Data data[block_size];
+    int size;
+  };
+  static const int FANOUT = (sizeof(Leaf) - sizeof(int)) / (sizeof(Data) + sizeof(int));
+  static_assert(block_size >= 2 && FANOUT >= 4, "block_size is too small for a B+ tree");
+  // keys[i] is a lower bound of everything under children[i]; keys[0] is never looked at
+  struct Internal {
+    int size;
+    Data keys[FANOUT];
+    int children[FANOUT];
+  };
+  // both kinds of node take the same extent, so one free list recycles them all
+  static const size_t NODE_BYTES = std::max(sizeof(Leaf), sizeof(Internal));
+  static const int MIN_LEAF = block_size / 2;
+  static const int MIN_INTERNAL = FANOUT / 2;
+  struct Split {
+    bool happened;
+    Data first;
+    int place;
+  };
   Storage storage_handler; // this should be defined before others to ensure correct initialization sequence
-  BlockList<Data, block_size, Storage> leaves;
-  int root;
- public:
-  BPlusTree(const char *str) : storage_handler(str), leaves(storage_handler), root(0) {}
-  vector<Data> find(const Data &begin, const Data &end, int list_root, int l = 0, int r = 0) {
-    if (list_root == &leaves) {
-      return leaves.find(begin, end);
+  Header header;
+  void write_header() {
+    storage_handler.write_at(0, header);
+  }
+  // first i with !(data[i] < x)
+  static int lower_bound(const Data *data, int size, const Data &x) {
+    int l = 0, r = size;
+    while (l < r) {
+      int mid = (l + r) / 2;
+      if (data[mid] < x) {
+        l = mid + 1;
+      } else {
+        r = mid;
+      }
     }
+    return l;
   }
-  void insert(const Data &x, int list_root, int l = 0, int r = 0) {
-    if (list_root == &leaves) {
-      leaves.insert(x);
-      return;
+  // the last child whose range holds x, where x is inserted
+  static int child_index(const Internal &node, const Data &x) {
+    int l = 1, r = node.size;
+    while (l < r) {
+      int mid = (l + r) / 2;
+      if (x < node.keys[mid]) {
+        r = mid;
+      } else {
+        l = mid + 1;
+      }
     }
+    return l - 1;
   }
-  void erase(const Data &x, int list_root, int l = 0, int r = 0) {
-    if (list_root == &leaves) {
-      leaves.erase(x);
-      return;
+  // The first child whose range holds x, where scans from x start. Equal entries
+  // may run on from it into the children after it, up to child_index(node, x).
+  static int first_child_index(const Internal &node, const Data &x) {
+    int l = 1, r = node.size;
+    while (l < r) {
+      int mid = (l + r) / 2;
+      if (node.keys[mid] < x) {
+        l = mid + 1;
+      } else {
+        r = mid;
+      }
+    }
+    return l - 1;
+  }
+  Split insert(int place, int height, const Data &x) {
+    if (height == 1) {
+      Leaf leaf;
+      storage_handler.read_at(place, leaf);
+      int pos = lower_bound(leaf.data, leaf.size, x);
+      if (leaf.size < static_cast<int>(block_size)) {
+        for (int i = leaf.size; i > pos; i--) {
+          leaf.data[i] = leaf.data[i - 1];
+        }
+        leaf.data[pos] = x;
+        leaf.size++;
+        storage_handler.write_at(place, leaf);
+        return Split{false, Data(), 0};
+      }
+      int right_place = storage_handler.allocate(NODE_BYTES);
+      Leaf right;
+      right.size = leaf.size - MIN_LEAF;
+      for (int i = 0; i < right.size; i++) {
+        right.data[i] = leaf.data[MIN_LEAF + i];
+      }
+      leaf.size = MIN_LEAF;
+      Leaf &target = pos <= MIN_LEAF ? leaf : right;
+      if (pos > MIN_LEAF) pos -= MIN_LEAF;
+      for (int i = target.size; i > pos; i--) {
+        target.data[i] = target.data[i - 1];
+      }
+      target.data[pos] = x;
+      target.size++;
+      right.next = leaf.next;
+      right.prev = place;
+      leaf.next = right_place;
+      if (right.next) {
+        storage_handler.write_batch({WriteRequest(place, leaf), WriteRequest(right_place, right),
+                                     WriteRequest(right.next + offsetof(Leaf, prev), right_place)});
+      } else {
+        storage_handler.write_batch({WriteRequest(place, leaf), WriteRequest(right_place, right)});
+      }
+      return Split{true, right.data[0], right_place};
+    }
+    Internal node;
+    storage_handler.read_at(place, node);
+    int index = child_index(node, x);
+    Split split = insert(node.children[index], height - 1, x);
+    if (!split.happened) return split;
+    int pos = index + 1;
+    if (node.size < FANOUT) {
+      for (int i = node.size; i > pos; i--) {
+        node.keys[i] = node.keys[i - 1];
+        node.children[i] = node.children[i - 1];
+      }
+      node.keys[pos] = split.first;
+      node.children[pos] = split.place;
+      node.size++;
+      storage_handler.write_at(place, node);
+      return Split{false, Data(), 0};
+    }
+    int right_place = storage_handler.allocate(NODE_BYTES);
+    Internal right;
+    right.size = node.size - MIN_INTERNAL;
+    for (int i = 0; i < right.size; i++) {
+      right.keys[i] = node.keys[MIN_INTERNAL + i];
+      right.children[i] = node.children[MIN_INTERNAL + i];
+    }
+    node.size = MIN_INTERNAL;
+    Internal &target = pos <= MIN_INTERNAL ? node : right;
+    if (pos > MIN_INTERNAL) pos -= MIN_INTERNAL;
+    for (int i = target.size; i > pos; i--) {
+      target.keys[i] = target.keys[i - 1];
+      target.children[i] = target.children[i - 1];
+    }
+    target.keys[pos] = split.first;
+    target.children[pos] = split.place;
+    target.size++;
+    storage_handler.write_batch({WriteRequest(place, node), WriteRequest(right_place, right)});
+    return Split{true, right.keys[0], right_place};
+  }
+  // Evens out node.children[index] after it fell under the minimum, either by
+  // merging it with a neighbour or by moving entries over from one.
+  void rebalance(Internal &node, int index, int child_height) {
+    int left_index = index + 1 < node.size ? index : index - 1;
+    int right_index = left_index + 1;
+    int left_place = node.children[left_index], right_place = node.children[right_index];
+    bool merged;
+    if (child_height == 1) {
+      Leaf left, right;
+      storage_handler.read_batch({ReadRequest(left_place, left), ReadRequest(right_place, right)});
+      merged = left.size + right.size <= static_cast<int>(block_size);
+      if (merged) {
+        for (int i = 0; i < right.size; i++) {
+          left.data[left.size + i] = right.data[i];
+        }
+        left.size += right.size;
+        left.next = right.next;
+        if (left.next) {
+          storage_handler.write_batch({WriteRequest(left_place, left),
+                                       WriteRequest(left.next + offsetof(Leaf, prev), left_place)});
+        } else {
+          storage_handler.write_at(left_place, left);
+        }
+      } else {
+        int total = left.size + right.size, target = total / 2;
+        if (left.size > target) {
+          int moved = left.size - target;
+          for (int i = right.size - 1; i >= 0; i--) {
+            right.data[i + moved] = right.data[i];
+          }
+          for (int i = 0; i < moved; i++) {
+            right.data[i] = left.data[target + i];
+          }
+        } else {
+          int moved = target - left.size;
+          for (int i = 0; i < moved; i++) {
+            left.data[left.size + i] = right.data[i];
+          }
+          for (int i = moved; i < right.size; i++) {
+            right.data[i - moved] = right.data[i];
+          }
+        }
+        left.size = target;
+        right.size = total - target;
+        node.keys[right_index] = right.data[0];
+        storage_handler.write_batch({WriteRequest(left_place, left), WriteRequest(right_place, right)});
+      }
+    } else {
+      Internal left, right;
+      storage_handler.read_batch({ReadRequest(left_place, left), ReadRequest(right_place, right)});
+      // the separator in node stands in for right.keys[0] while entries move around
+      right.keys[0] = node.keys[right_index];
+      merged = left.size + right.size <= FANOUT;
+      if (merged) {
+        for (int i = 0; i < right.size; i++) {
+          left.keys[left.size + i] = right.keys[i];
+          left.children[left.size + i] = right.children[i];
+        }
+        left.size += right.size;
+        storage_handler.write_at(left_place, left);
+      } else {
+        int total = left.size + right.size, target = total / 2;
+        if (left.size > target) {
+          int moved = left.size - target;
+          for (int i = right.size - 1; i >= 0; i--) {
+            right.keys[i + moved] = right.keys[i];
+            right.children[i + moved] = right.children[i];
+          }
+          for (int i = 0; i < moved; i++) {
+            right.keys[i] = left.keys[target + i];
+            right.children[i] = left.children[target + i];
+          }
+        } else {
+          int moved = target - left.size;
+          for (int i = 0; i < moved; i++) {
+            left.keys[left.size + i] = right.keys[i];
+            left.children[left.size + i] = right.children[i];
+          }
+          for (int i = moved; i < right.size; i++) {
+            right.keys[i - moved] = right.keys[i];
+            right.children[i - moved] = right.children[i];
+          }
+        }
+        left.size = target;
+        right.size = total - target;
+        node.keys[right_index] = right.keys[0];
+        storage_handler.write_batch({WriteRequest(left_place, left), WriteRequest(right_place, right)});
+      }
+    }
+    if (merged) {
+      for (int i = right_index; i + 1 < node.size; i++) {
+        node.keys[i] = node.keys[i + 1];
+        node.children[i] = node.children[i + 1];
+      }
+      node.size--;
+      storage_handler.release(right_place, NODE_BYTES);
+    }
+  }
+  // what erasing from the node at place came to: UNDERFULL if it fell under the minimum fill
+  enum Erased { MISSING, ERASED, UNDERFULL };
+  Erased erase(int place, int height, const Data &x) {
+    if (height == 1) {
+      Leaf leaf;
+      storage_handler.read_at(place, leaf);
+      int pos = lower_bound(leaf.data, leaf.size, x);
+      if (pos == leaf.size || x < leaf.data[pos]) return MISSING;
+      leaf.size--;
+      for (int i = pos; i < leaf.size; i++) {
+        leaf.data[i] = leaf.data[i + 1];
+      }
+      storage_handler.write_at(place, leaf);
+      return leaf.size < MIN_LEAF ? UNDERFULL : ERASED;
+    }
+    Internal node;
+    storage_handler.read_at(place, node);
+    // a child whose separator equals x may have lost its copies of x while the
+    // child before it still holds some, so those are tried too, right to left
+    int index = child_index(node, x);
+    Erased erased;
+    while ((erased = erase(node.children[index], height - 1, x)) == MISSING) {
+      if (index == 0 || node.keys[index] < x) return MISSING;
+      index--;
     }
+    if (erased == ERASED) return ERASED;
+    rebalance(node, index, height - 1);
+    storage_handler.write_at(place, node);
+    return node.size < MIN_INTERNAL ? UNDERFULL : ERASED;
+  }
+ public:
+  BPlusTree(const char *str) : storage_handler(str) {
+    if (storage_handler.file_size() >= FREE_LIST + static_cast<int>(sizeof(int))) {
+      storage_handler.read_at(0, header);
+    } else {
+      header = {0, 0};
+      storage_handler.write_batch({WriteRequest(0, header), WriteRequest(FREE_LIST, 0)});
+    }
+    storage_handler.track_free_blocks(NODE_BYTES, FREE_LIST);
+  }
+  BPlusTree(const BPlusTree &) = delete;
+  BPlusTree& operator = (const BPlusTree &) = delete;
+  // Walks the entries from begin through end in order a leaf at a time, holding
+  // one leaf instead of collecting every match. The tree must not change while a
+  // cursor is in use.
+  class Cursor {
+   private:
+    BPlusTree &tree;
+    Data const end;
+    Leaf leaf;
+    int i;
+    bool valid;
+    // moves on to the first entry at or after i, into later leaves if need be
+    void settle() {
+      while (i == leaf.size) {
+        if (leaf.next == 0) {
+          valid = false;
+          return;
+        }
+        tree.storage_handler.read_at(leaf.next, leaf);
+        i = 0;
+        // from the second leaf on, ask for the next one ahead of time
+        if (leaf.next) tree.storage_handler.prefetch(leaf.next, sizeof(Leaf));
+      }
+      if (end < leaf.data[i]) valid = false;
+    }
+   public:
+    Cursor(BPlusTree &tree_, const Data &begin, const Data &end_) : tree(tree_), end(end_), i(0), valid(false) {
+      if (tree.header.root == 0) return;
+      int place = tree.header.root;
+      for (int height = tree.header.height; height > 1; height--) {
+        Internal node;
+        tree.storage_handler.read_at(place, node);
+        place = node.children[first_child_index(node, begin)];
+      }
+      tree.storage_handler.read_at(place, leaf);
+      i = lower_bound(leaf.data, leaf.size, begin);
+      valid = true;
+      settle();
+    }
+    Cursor(const Cursor &) = delete;
+    Cursor& operator = (const Cursor &) = delete;
+    explicit operator bool() const {
+      return valid;
+    }
+    const Data& operator*() const {
+      return leaf.data[i];
+    }
+    const Data* operator->() const {
+      return &leaf.data[i];
+    }
+    Cursor& operator++() {
+      i++;
+      settle();
+      return *this;
+    }
+  };
+  Cursor scan(const Data &begin, const Data &end) {
+    return Cursor(*this, begin, end);
   }
   vector<Data> find(const Data &begin, const Data &end) {
-    return find(begin, end, root);
+    vector<Data> ret{};
+    for (Cursor cursor(*this, begin, end); cursor; ++cursor) {
+      ret.push_back(*cursor);
+    }
+    return ret;
   }
   void insert(const Data &x) {
-    insert(x, root);
+    OperationGuard guard(storage_handler);
+    if (header.root == 0) {
+      Leaf leaf;
+      leaf.next = leaf.prev = 0;
+      leaf.data[0] = x;
+      leaf.size = 1;
+      header.root = storage_handler.allocate(NODE_BYTES);
+      header.height = 1;
+      storage_handler.write_batch({WriteRequest(header.root, leaf), WriteRequest(0, header)});
+      return;
+    }
+    Split split = insert(header.root, header.height, x);
+    if (!split.happened) return;
+    Internal root;
+    root.size = 2;
+    root.keys[0] = root.keys[1] = split.first;
+    root.children[0] = header.root;
+    root.children[1] = split.place;
+    header.root = storage_handler.allocate(NODE_BYTES);
+    header.height++;
+    storage_handler.write_batch({WriteRequest(header.root, root), WriteRequest(0, header)});
   }
   void erase(const Data &x) {
-    erase(x, root);
+    OperationGuard guard(storage_handler);
+    if (header.root == 0) return;
+    if (erase(header.root, header.height, x) != UNDERFULL) return;
+    int old_root = header.root;
+    if (header.height == 1) {
+      int size;
+      storage_handler.read_at(old_root + offsetof(Leaf, size), size);
+      if (size) return;
+      header.root = 0;
+      header.height = 0;
+    } else {
+      Internal root;
+      storage_handler.read_at(old_root, root);
+      if (root.size > 1) return;
+      header.root = root.children[0];
+      header.height--;
+    }
+    write_header();
+    storage_handler.release(old_root, NODE_BYTES);
+  }
+  int height() const {
+    return header.height;
   }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -7,21 +7,29 @@
 #include "utility.hpp"
 #include <string>
 #include <string_view>
+#include <condition_variable>
+#include <exception>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
 using std::string, std::string_view;
 
-template<typename T>
+template<typename T, typename Storage = FileStorage>
+requires random_access_storage<Storage>
 class FileVector {
  private:
-  FileStorage file;
+  Storage file;
   int size_;
  public:
   class ReferenceType {
    private:
     T value;
     int place;
-    FileStorage file;
-    ReferenceType(int p, FileStorage f) : place(p), file(f) {
+    Storage file;
+    ReferenceType(int p, Storage f) : place(p), file(f) {
       if (place) file.read_at(place, value);
     }
    public:
@@ -61,7 +69,10 @@ class FileVector {
       return place;
     }
     ~ReferenceType() {
-      if (place) file.write_at(place, value);
+      if (place) {
+        OperationGuard guard(file);
+        file.write_at(place, value);
+      }
     }
     friend FileVector;
   };
@@ -87,8 +98,16 @@ class FileVector {
   ReferenceType make_reference(int x) {
     return {x, file};
   }
+  // the value at x, copied out of the file
+  T get(int x) {
+    if (x < 0 || x >= size_) throw sjtu::index_out_of_bound();
+    T value;
+    file.read_at(sizeof(int) + x * sizeof(T), value);
+    return value;
+  }
   void push_back(const T& x) {
-    file.write_at(file.file_size(), x);
+    OperationGuard guard(file);
+    file.write_at(file.allocate(sizeof(T)), x);
     size_++;
   }
   int size() const { return size_; }
@@ -100,19 +119,33 @@ class FileVector {
   }
 };
 
-template<typename Key, typename Value>
+template<typename Key, typename Value, typename Storage = FileStorage>
 requires (std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value)
 class UniqueMap {
  private:
-  BlockBlockList<trivial_pair<Key, int>, 4096 / sizeof(trivial_pair<Key, int>)> map1;
-  FileVector<Value> map2;
+  // sized by the head blocks, whose entries are the larger ones
+  BlockBlockList<trivial_pair<Key, int>, block_capacity<sjtu::pair<trivial_pair<Key, int>, int>>(), Storage> map1;
+  FileVector<Value, Storage> map2;
  public:
-  using ReferenceType = FileVector<Value>::ReferenceType;
+  using ReferenceType = FileVector<Value, Storage>::ReferenceType;
   UniqueMap(const string& s) : map1(s + "_map1"), map2(s + "_map2") {}
+  // one of several maps sharing the name s, in s_map1_<part> and s_map2_<part>
+  UniqueMap(const string& s, int part) :
+      map1(s + "_map1_" + std::to_string(part)), map2(s + "_map2_" + std::to_string(part)) {}
   void insert(const Key& key, const Value& value) {
     map1.insert(make_trivial_pair(key, map2.size()));
     map2.push_back(value);
   }
+  // inserts the (first, second) pairs of [first, last) with one pass over the leaves
+  template<typename Iterator>
+  void insert_batch(Iterator first, Iterator last) {
+    std::vector<trivial_pair<Key, int>> keys;
+    for (; first != last; ++first) {
+      keys.push_back(make_trivial_pair(first->first, map2.size()));
+      map2.push_back(first->second);
+    }
+    map1.insert_batch(keys.begin(), keys.end());
+  }
   ReferenceType operator [] (const Key& key) {
     auto tmp = map1.find(make_trivial_pair(key, 0), make_trivial_pair(key, INT_MAX));
     if (tmp.size() > 1) throw sjtu::runtime_error();
@@ -122,6 +155,14 @@ class UniqueMap {
   ReferenceType make_reference(int x) {
     return map2.make_reference(x);
   }
+  // the value of key, if it is in the map, read without a reference that would
+  // write it back
+  std::optional<Value> get(const Key& key) {
+    auto tmp = map1.find(make_trivial_pair(key, 0), make_trivial_pair(key, INT_MAX));
+    if (tmp.size() > 1) throw sjtu::runtime_error();
+    if (tmp.empty()) return std::nullopt;
+    return map2.get(tmp.front().second);
+  }
   bool erase(const Key& key) {
     auto tmp = map1.find(make_trivial_pair(key, 0), make_trivial_pair(key, INT_MAX));
     if (tmp.size() > 1) throw sjtu::runtime_error();
@@ -140,4 +181,200 @@ class UniqueMap {
   }
 };
 
+// UniqueMaps under one name, each key living in the one its hash picks. Every
+// shard has its own files and latch, so threads working on different shards
+// never wait for each other. Values are handed out and taken in by copy, under
+// the latch of their shard, so no update is lost to a reference written back
+// late; update() reads, changes and writes one back in a single step. Batches
+// and for_each run every shard at once on threads kept for the life of the map.
+template<typename Key, typename Value, int shards = 8, typename Storage = FileStorage>
+requires (std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value && shards > 0)
+class ShardedUniqueMap {
+ private:
+  struct alignas(64) Shard {
+    std::mutex latch;
+    UniqueMap<Key, Value, Storage> map;
+    Shard(const string& s, int part) : map(s, part) {}
+  };
+  // Threads for shards 1 and up, waiting for a task between calls; the thread
+  // handing one out takes shard 0 itself. One task runs at a time. The first
+  // exception a shard throws reaches the caller once every shard is done.
+  class Workers {
+   private:
+    std::mutex calling, mutex;
+    std::condition_variable wake, done;
+    const std::function<void(int)> *task = nullptr;
+    unsigned long long round = 0;
+    int running = 0;
+    bool stopping = false;
+    std::exception_ptr failure;
+    std::vector<std::thread> threads;
+    void work(int part) {
+      unsigned long long seen = 0;
+      std::unique_lock<std::mutex> lock(mutex);
+      while (true) {
+        wake.wait(lock, [&] { return stopping || round != seen; });
+        if (stopping) return;
+        seen = round;
+        lock.unlock();
+        std::exception_ptr thrown;
+        try {
+          (*task)(part);
+        } catch (...) {
+          thrown = std::current_exception();
+        }
+        lock.lock();
+        if (thrown && !failure) failure = thrown;
+        if (--running == 0) done.notify_one();
+      }
+    }
+   public:
+    Workers() {
+      for (int part = 1; part < shards; part++) {
+        threads.emplace_back(&Workers::work, this, part);
+      }
+    }
+    Workers(const Workers &) = delete;
+    Workers& operator = (const Workers &) = delete;
+    ~Workers() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+      }
+      wake.notify_all();
+      for (auto &thread : threads) {
+        thread.join();
+      }
+    }
+    // runs function(part) for every shard and returns once all of them are done
+    void run(const std::function<void(int)> &function) {
+      std::lock_guard<std::mutex> one_at_a_time(calling);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        task = &function;
+        running = threads.size();
+        failure = nullptr;
+        round++;
+      }
+      wake.notify_all();
+      std::exception_ptr thrown;
+      try {
+        function(0);
+      } catch (...) {
+        thrown = std::current_exception();
+      }
+      std::unique_lock<std::mutex> lock(mutex);
+      done.wait(lock, [&] { return running == 0; });
+      if (!thrown) thrown = failure;
+      failure = nullptr;
+      if (thrown) std::rethrow_exception(thrown);
+    }
+  };
+  std::vector<std::unique_ptr<Shard>> parts;
+  // destroyed first, so no worker outlives the shards
+  Workers workers;
+  template<typename Function>
+  void in_parallel(Function function) {
+    workers.run(std::function<void(int)>(function));
+  }
+ public:
+  ShardedUniqueMap(const string& s) {
+    for (int part = 0; part < shards; part++) {
+      parts.emplace_back(new Shard(s, part));
+    }
+  }
+  // Keys without a std::hash are hashed by their bytes, which equal keys then
+  // have to share, padding included.
+  static int shard_of(const Key& key) {
+    size_t hash;
+    if constexpr (requires { std::hash<Key>{}(key); }) {
+      hash = std::hash<Key>{}(key);
+    } else {
+      const unsigned char *bytes = reinterpret_cast<const unsigned char*>(&key);
+      hash = 14695981039346656037ull;
+      for (size_t i = 0; i < sizeof(Key); i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+      }
+    }
+    // std::hash of an integer is the integer, so spread it before taking the shard
+    return (static_cast<unsigned long long>(hash) * 11400714819323198485ull >> 32) % shards;
+  }
+  void insert(const Key& key, const Value& value) {
+    Shard &shard = *parts[shard_of(key)];
+    std::lock_guard<std::mutex> latch(shard.latch);
+    shard.map.insert(key, value);
+  }
+  // the value of key, if it is in the map; it is read and not written back
+  std::optional<Value> get(const Key& key) {
+    Shard &shard = *parts[shard_of(key)];
+    std::lock_guard<std::mutex> latch(shard.latch);
+    return shard.map.get(key);
+  }
+  // sets the value of key, if it is in the map; returns whether it was
+  bool assign(const Key& key, const Value& value) {
+    return update(key, [&] (Value& old) { old = value; }).has_value();
+  }
+  // Calls function on the value of key, if it is in the map, and writes back what
+  // it left there before another thread can see the value; returns that value.
+  template<typename Function>
+  std::optional<Value> update(const Key& key, Function function) {
+    Shard &shard = *parts[shard_of(key)];
+    std::lock_guard<std::mutex> latch(shard.latch);
+    auto reference = shard.map[key];
+    if (reference.empty()) return std::nullopt;
+    function(*reference);
+    return *reference;
+  }
+  bool erase(const Key& key) {
+    Shard &shard = *parts[shard_of(key)];
+    std::lock_guard<std::mutex> latch(shard.latch);
+    return shard.map.erase(key);
+  }
+  // Groups the (first, second) pairs of [first, last) by shard and inserts every
+  // group as a batch, all shards at once.
+  template<typename Iterator>
+  void insert_batch(Iterator first, Iterator last) {
+    std::vector<std::vector<trivial_pair<Key, Value>>> groups(shards);
+    for (; first != last; ++first) {
+      groups[shard_of(first->first)].push_back(make_trivial_pair(first->first, first->second));
+    }
+    in_parallel([&] (int part) {
+      if (groups[part].empty()) return;
+      std::lock_guard<std::mutex> latch(parts[part]->latch);
+      parts[part]->map.insert_batch(groups[part].begin(), groups[part].end());
+    });
+  }
+  // erases the keys of [first, last), grouped by shard likewise
+  template<typename Iterator>
+  void erase_batch(Iterator first, Iterator last) {
+    std::vector<std::vector<Key>> groups(shards);
+    for (; first != last; ++first) {
+      groups[shard_of(*first)].push_back(*first);
+    }
+    in_parallel([&] (int part) {
+      if (groups[part].empty()) return;
+      std::lock_guard<std::mutex> latch(parts[part]->latch);
+      for (const Key &key : groups[part]) {
+        parts[part]->map.erase(key);
+      }
+    });
+  }
+  int size() {
+    int total = 0;
+    for (auto &shard : parts) {
+      std::lock_guard<std::mutex> latch(shard->latch);
+      total += shard->map.size();
+    }
+    return total;
+  }
+  // calls foo on every value, the shards in parallel, so foo must be safe to
+  // call from several threads
+  void for_each(const std::function<void(Value&)>& foo) {
+    in_parallel([&] (int part) {
+      std::lock_guard<std::mutex> latch(parts[part]->latch);
+      parts[part]->map.for_each(foo);
+    });
+  }
+};
+
 #endif
\ No newline at end of file
@@ -64,13 +64,49 @@ U& extract_data(sjtu::pair<U, int>& x) { return x.first; }
 template <typename U>
 const U& extract_data(const sjtu::pair<U, int>& x) { return x.first; }
 
-template <typename T>
-struct AccumulativeFunc : public std::function<void(T)> {
-  AccumulativeFunc() = default;
-  template <typename... Args>
-  AccumulativeFunc(Args... args) : std::function<void(T)>(std::forward<Args...>(args...)) {}
-  AccumulativeFunc operator + (const AccumulativeFunc &other) {
-    return [&] (T x) { this->operator()(x); other.operator()(x); };
+// What a block in a BlockList leaves for the block above it once it changed: the
+// parent's entry for it gets a new key, a new sibling is filed after it, or the
+// entry goes. A split does the first two. Kept by value, so nothing is allocated.
+template <typename Key>
+struct ParentFixUp {
+  enum : int { NONE = 0, REPLACE = 1, INSERT = 2, ERASE = 4 };
+  int kind = NONE;
+  // REPLACE: the entry for the child block at child, filed under from, is filed
+  // under to; child tells it apart from entries of other blocks under the same key
+  Key from, to;
+  int child = 0;
+  // INSERT, ERASE: the entry for the child block starting with first at place
+  Key first;
+  int place = 0;
+  static ParentFixUp replacing(const Key &from, const Key &to, int child) {
+    return {REPLACE, from, to, child, Key(), 0};
+  }
+  static ParentFixUp splitting(const Key &from, const Key &to, int child, const Key &first, int place) {
+    return {REPLACE | INSERT, from, to, child, first, place};
+  }
+  static ParentFixUp erasing(const Key &first, int place) {
+    return {ERASE, Key(), Key(), 0, first, place};
+  }
+  // Folds in a later fix-up of the same block. Only rekeys may come before others,
+  // so the parent still sees a single rekey from the key it holds.
+  ParentFixUp& operator += (const ParentFixUp &later) {
+    if (later.kind & REPLACE) {
+      if (!(kind & REPLACE)) from = later.from;
+      to = later.to;
+      child = later.child;
+    }
+    if (later.kind & (INSERT | ERASE)) {
+      first = later.first;
+      place = later.place;
+    }
+    kind |= later.kind;
+    return *this;
+  }
+  template <typename Parent>
+  void apply(Parent &parent) const {
+    if (kind & REPLACE) parent.replace(from, to, child);
+    if (kind & INSERT) parent.insert(sjtu::pair<Key, int>(first, place), child);
+    if (kind & ERASE) parent.erase(sjtu::pair<Key, int>(first, place));
   }
 };
 
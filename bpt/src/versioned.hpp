@@ -0,0 +1,217 @@
+#pragma once
+
+#ifndef BPT_VERSIONED_
+#define BPT_VERSIONED_
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "file.hpp"
+#include "exceptions.hpp"
+
+// Snapshots in front of another storage. Writes still land on the pages in place,
+// but while a snapshot is open a page is first copied, as it stands, to a fresh
+// slot of <name>.versions, once per snapshot taken since. snapshot() hands out a
+// copy of the storage that reads every page as it was when it was called, from
+// those slots where the page has changed since, and that refuses writes. Each
+// snapshot stamps itself with the epoch, a count of snapshots taken; a kept page
+// knows the epoch it was overwritten in, so it can go once every open snapshot
+// is at least that new. A snapshot closes when the last copy of it dies.
+//
+// Writers and snapshot reads of the same pages exclude each other on one mutex,
+// held only while snapshots are open, when writes also pay for the copies. A
+// snapshot must be taken while no write is under way, which the storage does not
+// check: callers keep writers out themselves, as BlockBlockList does by taking
+// its root latch exclusively.
+template<typename Inner = FileStorage, int page_size = 4096>
+requires (random_access_storage<Inner> && page_size > 0)
+class VersionedStorage : public BasicStorage<VersionedStorage<Inner, page_size>> {
+ public:
+  // slots of <name>.versions holding a page for a snapshot, and slots free for reuse
+  struct Statistics {
+    int kept, free;
+  };
+ private:
+  // the page as it read before its first write in epoch until, kept at slot
+  struct Version {
+    unsigned long long until;
+    int slot;
+  };
+  struct Store {
+    Inner inner, kept;
+    std::mutex mutex;
+    std::atomic<int> open{0};
+    unsigned long long epoch = 1;
+    std::multiset<unsigned long long> pinned;
+    // per page, oldest first
+    std::unordered_map<int, std::vector<Version>> versions;
+    std::vector<int> free_slots;
+    int slots = 0;
+    Store(const char *name) : inner(name), kept((std::string(name) + ".versions").c_str()) {}
+    Store(const Store &) = delete;
+    Store& operator = (const Store &) = delete;
+    // Copies page out before it is written, unless no open snapshot reads it as
+    // it stands: every snapshot older than its last kept version reads that one.
+    void preserve(int page) {
+      auto it = versions.find(page);
+      unsigned long long since = it == versions.end() ? 0 : it->second.back().until;
+      if (since == epoch || pinned.lower_bound(since) == pinned.end()) return;
+      char data[page_size];
+      int begin = page * page_size;
+      int bytes = std::max(0, std::min(page_size, inner.file_size() - begin));
+      if (bytes > 0) inner.read(begin, data, bytes);
+      std::memset(data + bytes, 0, page_size - bytes);
+      int slot = slots;
+      if (free_slots.empty()) {
+        slots++;
+      } else {
+        slot = free_slots.back();
+        free_slots.pop_back();
+      }
+      kept.write(slot * page_size, data, page_size);
+      versions[page].push_back(Version{epoch, slot});
+    }
+    // the slot holding page as the snapshot at epoch read it, -1 if it is unchanged
+    int slot_as_of(int page, unsigned long long as_of) const {
+      auto it = versions.find(page);
+      if (it == versions.end()) return -1;
+      for (const Version &version : it->second) {
+        if (version.until > as_of) return version.slot;
+      }
+      return -1;
+    }
+    unsigned long long pin() {
+      std::lock_guard<std::mutex> lock(mutex);
+      pinned.insert(epoch);
+      open.fetch_add(1, std::memory_order_release);
+      return epoch++;
+    }
+    // frees what no open snapshot is old enough to read
+    void unpin(unsigned long long as_of) {
+      std::lock_guard<std::mutex> lock(mutex);
+      pinned.erase(pinned.find(as_of));
+      open.fetch_sub(1, std::memory_order_release);
+      unsigned long long oldest = pinned.empty() ? epoch : *pinned.begin();
+      for (auto it = versions.begin(); it != versions.end(); ) {
+        std::vector<Version> &list = it->second;
+        size_t stale = 0;
+        while (stale < list.size() && list[stale].until <= oldest) {
+          free_slots.push_back(list[stale++].slot);
+        }
+        list.erase(list.begin(), list.begin() + stale);
+        it = list.empty() ? versions.erase(it) : std::next(it);
+      }
+    }
+  };
+  struct Pin {
+    std::shared_ptr<Store> store;
+    unsigned long long as_of;
+    ~Pin() {
+      store->unpin(as_of);
+    }
+  };
+  std::shared_ptr<Store> store;
+  // set in the copies snapshot() hands out
+  std::shared_ptr<Pin> pin;
+  // calls function(place, bytes) for each page-sized piece of [place, place + bytes)
+  template<typename Function>
+  static void by_page(int place, size_t bytes, Function function) {
+    while (bytes > 0) {
+      size_t count = std::min(bytes, static_cast<size_t>(page_size - place % page_size));
+      function(place, count);
+      place += count;
+      bytes -= count;
+    }
+  }
+ public:
+  VersionedStorage(const char *name) : BasicStorage<VersionedStorage>(name), store(std::make_shared<Store>(name)) {
+    this->initialized_ = store->inner.initialized();
+  }
+  VersionedStorage(const VersionedStorage &) = default;
+  VersionedStorage(VersionedStorage &&) = default;
+  ~VersionedStorage() = default;
+  // a copy reading the pages as they are now, for as long as any copy of it lives
+  VersionedStorage snapshot() {
+    VersionedStorage view(*this);
+    view.pin.reset(new Pin{store, store->pin()});
+    return view;
+  }
+  void write(int place, const char *value, size_t bytes) {
+    if (pin) throw sjtu::runtime_error();
+    if (store->open.load(std::memory_order_acquire) == 0) {
+      store->inner.write(place, value, bytes);
+      return;
+    }
+    std::lock_guard<std::mutex> lock(store->mutex);
+    by_page(place, bytes, [&] (int at, size_t) { store->preserve(at / page_size); });
+    store->inner.write(place, value, bytes);
+  }
+  void write_vector(const WriteRequest *requests, size_t count) {
+    if (pin) throw sjtu::runtime_error();
+    if (store->open.load(std::memory_order_acquire) == 0) {
+      store->inner.write_vector(requests, count);
+      return;
+    }
+    std::lock_guard<std::mutex> lock(store->mutex);
+    for (size_t i = 0; i < count; i++) {
+      by_page(requests[i].place, requests[i].bytes, [&] (int at, size_t) { store->preserve(at / page_size); });
+    }
+    store->inner.write_vector(requests, count);
+  }
+  void read(int place, char *value, size_t bytes) {
+    if (!pin) {
+      store->inner.read(place, value, bytes);
+      return;
+    }
+    std::lock_guard<std::mutex> lock(store->mutex);
+    by_page(place, bytes, [&] (int at, size_t count) {
+      int slot = store->slot_as_of(at / page_size, pin->as_of);
+      if (slot == -1) {
+        store->inner.read(at, value, count);
+      } else {
+        store->kept.read(slot * page_size + at % page_size, value, count);
+      }
+      value += count;
+    });
+  }
+  void read_vector(const ReadRequest *requests, size_t count) {
+    if (!pin) {
+      store->inner.read_vector(requests, count);
+      return;
+    }
+    for (size_t i = 0; i < count; i++) {
+      read(requests[i].place, requests[i].value, requests[i].bytes);
+    }
+  }
+  int file_size() {
+    return store->inner.file_size();
+  }
+  int extend(size_t bytes) {
+    return store->inner.extend(bytes);
+  }
+  void begin_operation() {
+    store->inner.begin_operation();
+  }
+  void end_operation() {
+    store->inner.end_operation();
+  }
+  void sync() {
+    store->inner.sync();
+  }
+  void prefetch(int place, size_t bytes) {
+    if (!pin) store->inner.prefetch(place, bytes);
+  }
+  Statistics statistics() {
+    std::lock_guard<std::mutex> lock(store->mutex);
+    int free = store->free_slots.size();
+    return Statistics{store->slots - free, free};
+  }
+};
+
+#endif
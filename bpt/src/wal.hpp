@@ -0,0 +1,225 @@
+#pragma once
+
+#ifndef BPT_WAL_
+#define BPT_WAL_
+
+#include <memory>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "file.hpp"
+#include "exceptions.hpp"
+
+// Write-ahead logging in front of another storage. Pages written during an
+// operation are kept in memory; once group_size operations have finished they
+// are appended to <name>.wal as full page images followed by a checksummed
+// commit record, the log is fsync'ed once for the whole group, and only then
+// are the pages written to the data file. Opening replays every complete group
+// still in the log, so after a crash the data file reflects a whole number of
+// operations. The log is cut back after the data file has been synced.
+// When the last copy dies it commits and checkpoints what is left, and a failure
+// there is lost silently; sync() first to find out.
+template<typename Inner = FileStorage, int group_size = 64, int page_size = 4096>
+requires (random_access_storage<Inner> && group_size > 0 && page_size > 0)
+class LoggedStorage : public BasicStorage<LoggedStorage<Inner, group_size, page_size>> {
+ private:
+  static const int PAGE_TAG = 0x45474150;
+  static const int COMMIT_TAG = 0x54494d43;
+  static const long long CHECKPOINT_BYTES = 1ll << 26;
+  struct PageRecord {
+    int tag, page;
+  };
+  struct CommitRecord {
+    int tag, pages, size;
+    unsigned long long checksum;
+  };
+  static unsigned long long checksum(const char *data, size_t bytes) {
+    unsigned long long hash = 14695981039346656037ull;
+    for (size_t i = 0; i < bytes; i++) {
+      hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+    }
+    return hash;
+  }
+  struct Log {
+    Inner inner;
+    int fd, size, depth, operations;
+    long long log_bytes;
+    std::unordered_map<int, std::unique_ptr<char[]>> pages;
+    Log(const char *name) : inner(name), depth(0), operations(0), log_bytes(0) {
+      std::string log_name = std::string(name) + ".wal";
+      fd = ::open(log_name.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+      if (fd == -1) throw sjtu::runtime_error();
+      size = inner.file_size();
+      replay();
+    }
+    Log(const Log &) = delete;
+    Log& operator = (const Log &) = delete;
+    ~Log() {
+      try {
+        commit();
+        checkpoint();
+      } catch (...) {
+        // a destructor has no one to report to: callers that need to know sync() first
+      }
+      ::close(fd);
+    }
+    // copies what the data file holds of a page, zero-filling past its end
+    void load(int page, char *data) {
+      int begin = page * page_size;
+      int bytes = std::max(0, std::min(page_size, inner.file_size() - begin));
+      if (bytes > 0) inner.read(begin, data, bytes);
+      std::memset(data + bytes, 0, page_size - bytes);
+    }
+    void apply(int page, const char *data, int limit) {
+      int begin = page * page_size;
+      int bytes = std::min(page_size, limit - begin);
+      if (bytes > 0) inner.write(begin, data, bytes);
+    }
+    void replay() {
+      struct stat st;
+      if (::fstat(fd, &st) == -1) throw sjtu::runtime_error();
+      if (st.st_size == 0) return;
+      std::unique_ptr<char[]> log(new char[st.st_size]);
+      if (::pread(fd, log.get(), st.st_size, 0) != st.st_size) throw sjtu::runtime_error();
+      const long long record = sizeof(PageRecord) + page_size;
+      long long group = 0, place = 0;
+      int count = 0;
+      while (place + static_cast<long long>(sizeof(int)) <= st.st_size) {
+        int tag;
+        std::memcpy(&tag, log.get() + place, sizeof(tag));
+        if (tag == PAGE_TAG && place + record <= st.st_size) {
+          place += record;
+          count++;
+        } else if (tag == COMMIT_TAG && place + static_cast<long long>(sizeof(CommitRecord)) <= st.st_size) {
+          CommitRecord commit;
+          std::memcpy(&commit, log.get() + place, sizeof(commit));
+          if (commit.pages != count || commit.checksum != checksum(log.get() + group, place - group)) break;
+          for (long long p = group; p < place; p += record) {
+            PageRecord header;
+            std::memcpy(&header, log.get() + p, sizeof(header));
+            apply(header.page, log.get() + p + sizeof(header), commit.size);
+          }
+          size = commit.size;
+          place += sizeof(CommitRecord);
+          group = place;
+          count = 0;
+        } else {
+          break;
+        }
+      }
+      checkpoint();
+    }
+    char *page_for_write(int page) {
+      auto it = pages.find(page);
+      if (it != pages.end()) return it->second.get();
+      char *data = new char[page_size];
+      load(page, data);
+      pages.emplace(page, std::unique_ptr<char[]>(data));
+      return data;
+    }
+    void commit() {
+      operations = 0;
+      if (pages.empty()) return;
+      const size_t record = sizeof(PageRecord) + page_size;
+      size_t bytes = pages.size() * record + sizeof(CommitRecord);
+      std::unique_ptr<char[]> buffer(new char[bytes]);
+      char *cursor = buffer.get();
+      for (const auto &entry : pages) {
+        PageRecord header{PAGE_TAG, entry.first};
+        std::memcpy(cursor, &header, sizeof(header));
+        std::memcpy(cursor + sizeof(header), entry.second.get(), page_size);
+        cursor += record;
+      }
+      CommitRecord commit{COMMIT_TAG, static_cast<int>(pages.size()), size,
+                          checksum(buffer.get(), cursor - buffer.get())};
+      std::memcpy(cursor, &commit, sizeof(commit));
+      for (size_t written = 0; written < bytes; ) {
+        ssize_t result = ::write(fd, buffer.get() + written, bytes - written);
+        if (result <= 0) throw sjtu::runtime_error();
+        written += result;
+      }
+      if (::fdatasync(fd) == -1) throw sjtu::runtime_error();
+      log_bytes += bytes;
+      for (const auto &entry : pages) {
+        apply(entry.first, entry.second.get(), size);
+      }
+      pages.clear();
+      if (log_bytes > CHECKPOINT_BYTES) checkpoint();
+    }
+    void checkpoint() {
+      inner.sync();
+      if (::ftruncate(fd, 0) == -1) throw sjtu::runtime_error();
+      log_bytes = 0;
+    }
+  };
+  std::shared_ptr<Log> log;
+ public:
+  LoggedStorage(const char *name) : BasicStorage<LoggedStorage>(name), log(std::make_shared<Log>(name)) {
+    this->initialized_ = log->inner.initialized();
+  }
+  LoggedStorage(const LoggedStorage &) = default;
+  LoggedStorage(LoggedStorage &&) = default;
+  ~LoggedStorage() = default;
+  void write(int place, const char *value, size_t bytes) {
+    log->size = std::max(log->size, static_cast<int>(place + bytes));
+    while (bytes > 0) {
+      int page = place / page_size, offset = place % page_size;
+      size_t count = std::min(bytes, static_cast<size_t>(page_size - offset));
+      std::memcpy(log->page_for_write(page) + offset, value, count);
+      place += count;
+      value += count;
+      bytes -= count;
+    }
+  }
+  void read(int place, char *value, size_t bytes) {
+    char buffer[page_size];
+    while (bytes > 0) {
+      int page = place / page_size, offset = place % page_size;
+      size_t count = std::min(bytes, static_cast<size_t>(page_size - offset));
+      auto it = log->pages.find(page);
+      if (it != log->pages.end()) {
+        std::memcpy(value, it->second.get() + offset, count);
+      } else if (place + count <= static_cast<size_t>(log->inner.file_size())) {
+        log->inner.read(place, value, count);
+      } else {
+        log->load(page, buffer);
+        std::memcpy(value, buffer + offset, count);
+      }
+      place += count;
+      value += count;
+      bytes -= count;
+    }
+  }
+  int file_size() {
+    return log->size;
+  }
+  int extend(size_t bytes) {
+    int place = log->size;
+    log->size += bytes;
+    return place;
+  }
+  void begin_operation() {
+    log->depth++;
+  }
+  void end_operation() {
+    if (--log->depth == 0 && ++log->operations >= group_size) log->commit();
+  }
+  // Forces the operations finished so far into the log without waiting for the
+  // group. Refused inside an operation, which would be logged half done.
+  void commit() {
+    if (log->depth > 0) throw sjtu::runtime_error();
+    log->commit();
+  }
+  void sync() {
+    log->commit();
+    log->checkpoint();
+  }
+  void prefetch(int place, size_t bytes) {
+    log->inner.prefetch(place, bytes);
+  }
+};
+
+#endif